@@ -0,0 +1,90 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+// Fixed width bit packing of key frames: value i of b bits occupies
+// bits [i * b, (i + 1) * b) of a bit stream filled LSB first into
+// little endian bytes (the layout of dynamic_bitset<uint8_t> blocks,
+// which key frames were written with). Values are moved a word at a
+// time through a 64 bit accumulator instead of bit by bit.
+
+// bytes of n packed values of bits each
+inline size_t packedBytes(size_t n, unsigned bits) {
+  return (uint64_t(n) * bits + 7) / 8;
+}
+
+// Packs values of at most 32 bits into whole uint32_t words at out,
+// which has to hold (packedBytes + 3) / 4 words.
+struct BitPacker {
+  uint32_t *out;
+  uint64_t acc;  // pending bits
+  unsigned fill; // number of them, < 32
+
+  BitPacker(uint32_t *out) : out(out), acc(0), fill(0) {}
+
+  void put(uint32_t val, unsigned bits) {
+    acc |= uint64_t(val) << fill;
+    fill += bits;
+    if (fill >= 32) {
+      *out++ = acc;
+      acc >>= 32;
+      fill -= 32;
+    }
+  }
+
+  // write the pending bits, padded with 0
+  void flush() {
+    if (fill) *out++ = acc;
+    acc = fill = 0;
+  }
+};
+
+// Unpacks values of at most 32 bits from size bytes at in, which need
+// not be aligned; no byte beyond them is read.
+struct BitUnpacker {
+  const char *in, *end;
+  uint64_t acc;
+  unsigned fill;
+
+  BitUnpacker(const char *in, size_t size) : in(in), end(in + size), acc(0), fill(0) {}
+
+  uint32_t get(unsigned bits) {
+    if (fill < bits) {
+      uint32_t word = 0;
+      if (end - in >= 4) {
+	memcpy(&word, in, 4);
+	in += 4;
+      }else{
+	assert(in < end);
+	memcpy(&word, in, end - in);
+	in = end;
+      }
+      acc |= uint64_t(word) << fill;
+      fill += 32;
+    }
+    uint32_t res = acc & ((uint64_t(1) << bits) - 1);
+    acc >>= bits;
+    fill -= bits;
+    return res;
+  }
+};
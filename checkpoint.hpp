@@ -0,0 +1,135 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hpp"
+#include "decompressor.hpp"
+
+// Decoder checkpoints of one block allow to start decoding in the
+// middle of it. They are stored in a side chunk directly after the
+// block (and referenced by the block index):
+//
+//   CheckpointHeader, CheckpointEntry[count], encoded states
+//
+// A checkpoint holds the state saved by DecompressorState::saveState
+// right before a frame is read, encoded with the block's integer
+// codec, and the position of the SVI chunk that is current then.
+struct CheckpointHeader {
+  uint32_t count;
+  uint32_t numTraj;
+};
+
+struct CheckpointEntry {
+  uint32_t frame;       // frame within the block to be read next
+  uint32_t chunkCur;    // SVIs of the current chunk already read
+  uint64_t chunkOffset; // of the current chunk, relative to the block
+  uint64_t stateOffset; // relative to the end of the entries
+  uint32_t stateSize;   // encoded state in uint32_t
+  uint32_t reserved;
+};
+
+// Decode a compressed block (as written by CompressorState) and
+// return checkpoints every interval frames as side chunk payload.
+template<typename Real>
+vector<char> buildCheckpoints(const vector<char> &block, TId numTraj, Time interval,
+			      function<DecompressorState<Real>*(ChunkSource)> decompressorFactory) {
+  const char *cur = block.data(), *end = block.data() + block.size();
+  uint64_t curChunk = 0;
+  DecompressorState<Real> *decompressor = decompressorFactory([&](char*, const char *&data) {
+    curChunk = cur - block.data();
+    return nextChunk(cur, end, data);
+  });
+  CodecPtr codec = decompressor->decoder;
+
+  vector<CheckpointEntry> entries;
+  vector<uint32_t> states;
+  vector<uint32_t> state(decompressor->stateSize()), encoded(codec->require(state.size()));
+  for (;;) {
+    // save the state before reading a frame, keep it only if there
+    // is a frame to read
+    Time frame = decompressor->curTime;
+    bool checkpoint = frame && !(frame % interval);
+    CheckpointEntry entry;
+    if (checkpoint) {
+      decompressor->saveState(state.data());
+      uint64_t size = encoded.size();
+      codec->encodeArray(state.data(), state.size(), encoded.data(), &size);
+      entry.frame = frame;
+      entry.chunkCur = decompressor->chunkCur;
+      entry.chunkOffset = curChunk;
+      entry.stateOffset = states.size() * sizeof(uint32_t);
+      entry.stateSize = size;
+      entry.reserved = 0;
+    }
+    if (!decompressor->readFrame(nullptr)) break;
+    if (checkpoint) {
+      entries.push_back(entry);
+      states.insert(states.end(), encoded.begin(), encoded.begin() + entry.stateSize);
+    }
+  }
+  delete decompressor;
+
+  CheckpointHeader header;
+  header.count = entries.size();
+  header.numTraj = numTraj;
+  vector<char> res;
+  res.insert(res.end(), (char*) &header, (char*) &header + sizeof(header));
+  res.insert(res.end(), (char*) entries.data(), (char*) (entries.data() + entries.size()));
+  res.insert(res.end(), (char*) states.data(), (char*) (states.data() + states.size()));
+  return res;
+}
+
+// Restore the last checkpoint at or before frame of the block at
+// blockOffset in the seekable file fd, whose checkpoint side chunk
+// starts at checkpointOffset. seek has to position the decompressor's
+// chunk source at the given file offset. Returns the frame of the
+// checkpoint, 0 if there is none (and nothing is changed).
+template<typename Real>
+Time restoreCheckpoint(int fd, uint64_t blockOffset, uint64_t checkpointOffset,
+		       DecompressorState<Real> &decompressor, Time frame,
+		       function<void(uint64_t)> seek) {
+  ChunkSize chunkSize;
+  assert(pread(fd, &chunkSize, sizeof(chunkSize), checkpointOffset) == sizeof(chunkSize));
+  assert(isSideChunk(chunkSize));
+  vector<char> side(chunkSize.compressed);
+  assert(pread(fd, side.data(), side.size(), checkpointOffset + sizeof(chunkSize)) == ssize_t(side.size()));
+
+  CheckpointHeader header;
+  memcpy(&header, side.data(), sizeof(header));
+  assert(header.numTraj == decompressor.numTraj);
+  const CheckpointEntry *entries = (CheckpointEntry*) (side.data() + sizeof(header));
+  const char *states = (char*) (entries + header.count);
+
+  // entries are sorted by frame
+  const CheckpointEntry *best = nullptr;
+  for (uint32_t i=0; (i<header.count) && (entries[i].frame <= frame); i++)
+    best = entries + i;
+  if (!best) return 0;
+
+  vector<uint32_t> state(DECODE_REQUIRE_MEM(decompressor.stateSize()));
+  decompressor.decoder->decodeArray((uint32_t*) (states + best->stateOffset), best->stateSize,
+				    state.data(), decompressor.stateSize());
+  seek(blockOffset + best->chunkOffset);
+  decompressor.restoreState(best->frame, state.data(), best->chunkCur);
+  return best->frame;
+}
@@ -0,0 +1,361 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+#include <integer_encoding.hpp>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Backend compressing arrays of uint32_t (SVI chunks, checkpoints),
+// with the interface of the integer_encoding_library codecs: encoded
+// arrays are in whole uint32_t words (nvalue resp. len), require()
+// bounds the encoded size of len values.
+struct Codec {
+  virtual void encodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t *nvalue) const = 0;
+  virtual void decodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t nvalue) const = 0;
+  virtual uint64_t require(uint64_t len) const = 0;
+  // SVI chunks store dt and v as separate arrays
+  virtual bool separateStreams() const { return false; }
+  virtual ~Codec() {}
+};
+
+typedef shared_ptr<Codec> CodecPtr;
+
+// a codec of the integer_encoding_library
+struct LibraryCodec : Codec {
+  integer_encoding::EncodingPtr codec;
+
+  LibraryCodec(int id) : codec(integer_encoding::EncodingFactory::create(id)) {}
+
+  void encodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t *nvalue) const {
+    codec->encodeArray(in, len, out, nvalue);
+  }
+  void decodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t nvalue) const {
+    codec->decodeArray((uint32_t*) in, len, out, nvalue);
+  }
+  uint64_t require(uint64_t len) const { return codec->require(len); }
+};
+
+// Interleaved rANS with a frequency table per array, for the skewed
+// but stable distributions of dt and zigzagged v. A value is split
+// into a symbol (values below 16 itself, above its bit length and the
+// bit after the leading one) that is entropy coded, and the remaining
+// low bits that are stored as they are.
+//
+// Encoded layout (little endian bytes, padded to whole words):
+//
+//   uint32 bytes of the rANS stream, uint8 number of symbols,
+//   frequencies (varbyte), uint32 final state of each lane,
+//   rANS stream (uint16 words), low bits (LSB first)
+//
+// Value i is coded by lane i % lanes; the lanes share one stream so
+// that decoding them is independent (and vectorized with AVX2).
+struct RansCodec : Codec {
+  static const int lanes = 8;
+  static const int scaleBits = 11;       // frequencies sum up to 1 << scaleBits
+  static const uint32_t lower = 1 << 16; // states are in [lower, lower << 16)
+  static const int numSymbols = 72;
+
+  static int symbol(uint32_t v) {
+    if (v < 16) return v;
+    int n = 31 - __builtin_clz(v);
+    return 16 + 2 * (n - 4) + ((v >> (n - 1)) & 1);
+  }
+
+  // number of low bits stored for a symbol
+  static int lowBits(int s) { return s < 16 ? 0 : 3 + (s - 16) / 2; }
+
+  static uint32_t value(int s, uint32_t low) {
+    if (s < 16) return s;
+    int n = 4 + (s - 16) / 2;
+    return (uint32_t(2 | ((s - 16) & 1)) << (n - 1)) | low;
+  }
+
+  uint64_t require(uint64_t len) const {
+    // per value: at most one stream word and 30 low bits
+    return (4 + 1 + 3 * numSymbols + 4 * lanes + 6 * len + 8) / 4 + 1;
+  }
+
+  void encodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t *nvalue) const {
+    // normalized frequencies; every present symbol keeps at least 1
+    uint64_t count[numSymbols] = {0};
+    for (uint64_t i=0; i<len; i++)
+      count[symbol(in[i])]++;
+    uint32_t freq[numSymbols], start[numSymbols + 1];
+    int used = 0;
+    int64_t sum = 0;
+    for (int s=0; s<numSymbols; s++) {
+      freq[s] = count[s] ? max<uint64_t>(1, (count[s] << scaleBits) / len) : 0;
+      sum += freq[s];
+      if (count[s]) used = s + 1;
+    }
+    while (len && (sum != (1 << scaleBits))) {
+      // adjust the most frequent symbol that can take it
+      int best = -1;
+      for (int s=0; s<numSymbols; s++)
+	if (((sum < (1 << scaleBits)) ? count[s] : (freq[s] > 1)) && ((best < 0) || (count[s] > count[best])))
+	  best = s;
+      int64_t d = (1 << scaleBits) - sum;
+      if (d < 0) d = -min<int64_t>(-d, freq[best] - 1);
+      freq[best] += d;
+      sum += d;
+    }
+    start[0] = 0;
+    for (int s=0; s<numSymbols; s++)
+      start[s + 1] = start[s] + freq[s];
+
+    // rANS stream, written backwards
+    vector<uint16_t> words(len + 1);
+    uint16_t *w = words.data() + words.size();
+    uint32_t x[lanes];
+    for (int l=0; l<lanes; l++)
+      x[l] = lower;
+    for (uint64_t i=len; i--; ) {
+      int s = symbol(in[i]);
+      uint32_t &xl = x[i % lanes];
+      if (xl >= (uint64_t(lower >> scaleBits) << 16) * freq[s]) {
+	*--w = xl & 0xffff;
+	xl >>= 16;
+      }
+      xl = ((xl / freq[s]) << scaleBits) + (xl % freq[s]) + start[s];
+    }
+    uint32_t streamBytes = (words.data() + words.size() - w) * sizeof(uint16_t);
+
+    uint8_t *o = (uint8_t*) out, *begin = o;
+    memcpy(o, &streamBytes, 4);   o += 4;
+    *o++ = used;
+    for (int s=0; s<used; s++) {
+      for (uint32_t f = freq[s]; ; f >>= 7) {
+	*o++ = (f & 127) | (f >= 128 ? 128 : 0);
+	if (f < 128) break;
+      }
+    }
+    memcpy(o, x, sizeof(x));      o += sizeof(x);
+    memcpy(o, w, streamBytes);    o += streamBytes;
+
+    uint64_t acc = 0;
+    int bits = 0;
+    for (uint64_t i=0; i<len; i++) {
+      int s = symbol(in[i]), n = lowBits(s);
+      acc |= uint64_t(in[i] & ((uint32_t(1) << n) - 1)) << bits;
+      for (bits += n; bits >= 8; bits -= 8, acc >>= 8)
+	*o++ = acc;
+    }
+    if (bits) *o++ = acc;
+    while ((o - begin) % 4) *o++ = 0;
+    *nvalue = (o - begin) / 4;
+  }
+
+  void decodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t nvalue) const {
+    const uint8_t *p = (const uint8_t*) in, *end = p + len * 4;
+    uint32_t streamBytes;
+    memcpy(&streamBytes, p, 4);   p += 4;
+    int used = *p++;
+    assert(used <= numSymbols);
+
+    // slot -> (freq, start, symbol) packed into 13, 12 and 7 bits
+    uint32_t table[1 << scaleBits];
+    uint32_t start = 0;
+    for (int s=0; s<used; s++) {
+      uint32_t f = 0;
+      for (int shift=0; ; shift+=7) {
+	f |= uint32_t(*p & 127) << shift;
+	if (!(*p++ & 128)) break;
+      }
+      assert(start + f <= (1 << scaleBits));
+      for (uint32_t j=start; j<start+f; j++)
+	table[j] = f | (start << 13) | (s << 25);
+      start += f;
+    }
+    assert(!nvalue || (start == (1 << scaleBits)));
+
+    uint32_t x[lanes];
+    memcpy(x, p, sizeof(x));      p += sizeof(x);
+    const uint8_t *stream = p, *streamEnd = p + streamBytes;
+    p = streamEnd;
+    assert(p <= end);
+
+    // symbols first (into out), then the low bits
+    uint64_t i = 0;
+#ifdef __AVX2__
+    i = decodeSymbolsAVX2(table, x, stream, streamEnd, out, nvalue);
+#endif
+    for (; i<nvalue; i++) {
+      uint32_t &xl = x[i % lanes];
+      uint32_t e = table[xl & ((1 << scaleBits) - 1)];
+      xl = (e & 0x1fff) * (xl >> scaleBits) + (xl & ((1 << scaleBits) - 1)) - ((e >> 13) & 0xfff);
+      if (xl < lower) {
+	uint16_t word;
+	assert(stream + 2 <= streamEnd);
+	memcpy(&word, stream, 2);
+	stream += 2;
+	xl = (xl << 16) | word;
+      }
+      out[i] = e >> 25;
+    }
+
+    // refill whole words while they are within the input
+    uint8_t numLowBits[numSymbols];
+    uint32_t base[numSymbols];
+    for (int s=0; s<numSymbols; s++) {
+      numLowBits[s] = lowBits(s);
+      base[s] = value(s, 0);
+    }
+    uint64_t acc = 0;
+    int bits = 0;
+    for (uint64_t i=0; i<nvalue; i++) {
+      int n = numLowBits[out[i]];
+      if (bits < n) {
+	if (p + 8 <= end) {
+	  uint64_t word;
+	  memcpy(&word, p, 8);
+	  acc |= word << bits;
+	  p += (63 - bits) >> 3;
+	  bits |= 56;
+	}else{
+	  for (; bits < n; bits += 8)
+	    acc |= uint64_t(p < end ? *p++ : 0) << bits;
+	}
+      }
+      out[i] = base[out[i]] | (acc & ((uint64_t(1) << n) - 1));
+      acc >>= n;
+      bits -= n;
+    }
+  }
+
+#ifdef __AVX2__
+  // Decode symbols of whole groups of lanes as long as the stream
+  // holds a word for each lane; returns the number decoded.
+  static uint64_t decodeSymbolsAVX2(const uint32_t *table, uint32_t *x, const uint8_t *&stream,
+				    const uint8_t *streamEnd, uint32_t *out, uint64_t n) {
+    // for each mask of lanes to refill: the index of the stream word
+    // each lane takes (consecutive in lane order)
+    static const struct Shuffle {
+      uint32_t idx[256][8];
+      Shuffle() {
+	for (int m=0; m<256; m++)
+	  for (int l=0, k=0; l<8; l++)
+	    idx[m][l] = (m >> l) & 1 ? k++ : 0;
+      }
+    } shuffle;
+
+    const __m256i slotMask = _mm256_set1_epi32((1 << scaleBits) - 1),
+		  freqMask = _mm256_set1_epi32(0x1fff),
+		  startMask = _mm256_set1_epi32(0xfff);
+    __m256i vx = _mm256_loadu_si256((__m256i*) x);
+    uint64_t i = 0;
+    for (; (i + lanes <= n) && (stream + 2 * lanes <= streamEnd); i += lanes) {
+      __m256i e = _mm256_i32gather_epi32((const int*) table, _mm256_and_si256(vx, slotMask), 4);
+      vx = _mm256_sub_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(e, freqMask),
+								 _mm256_srli_epi32(vx, scaleBits)),
+					     _mm256_and_si256(vx, slotMask)),
+			    _mm256_and_si256(_mm256_srli_epi32(e, 13), startMask));
+      _mm256_storeu_si256((__m256i*) (out + i), _mm256_srli_epi32(e, 25));
+      // refill the lanes below lower (1 << 16) by the next stream words
+      __m256i refill = _mm256_cmpeq_epi32(_mm256_srli_epi32(vx, 16), _mm256_setzero_si256());
+      int mask = _mm256_movemask_ps(_mm256_castsi256_ps(refill));
+      __m256i words = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) stream));
+      words = _mm256_permutevar8x32_epi32(words, _mm256_loadu_si256((const __m256i*) shuffle.idx[mask]));
+      vx = _mm256_blendv_epi8(vx, _mm256_or_si256(_mm256_slli_epi32(vx, 16), words), refill);
+      stream += 2 * __builtin_popcount(mask);
+    }
+    _mm256_storeu_si256((__m256i*) x, vx);
+    return i;
+  }
+#endif
+};
+
+// codec ids (--integer-encoding) beyond those of integer_encoding_library
+const int ransCodecId = 100;
+
+inline CodecPtr createCodec(int id) {
+  if (id == ransCodecId) return CodecPtr(new RansCodec());
+  return CodecPtr(new LibraryCodec(id));
+}
+
+// whether createCodec(id) works; the library throws for unknown ids
+inline bool codecExists(int id) {
+  try {
+    return (id == ransCodecId) || integer_encoding::EncodingFactory::create(id);
+  } catch (...) {
+    return false;
+  }
+}
+
+// Codec trying each of several candidates on every array and keeping
+// the smallest result, preceded by the id of the codec chosen, so
+// that decoding does not depend on the candidates. Used to code dt
+// and v of SVI chunks separately (--stream-codecs).
+struct SelectCodec : Codec {
+  vector<int> ids;
+  vector<CodecPtr> candidates;
+  mutable vector<uint32_t> trial;
+
+  SelectCodec(const vector<int> &ids) : ids(ids) {
+    assert(!ids.empty());
+    for (int id : ids)
+      candidates.push_back(createCodec(id));
+  }
+
+  bool separateStreams() const { return true; }
+
+  uint64_t require(uint64_t len) const {
+    uint64_t res = 0;
+    for (auto &c : candidates)
+      res = max(res, c->require(len));
+    return 1 + res;
+  }
+
+  void encodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t *nvalue) const {
+    uint64_t best = *nvalue - 1;
+    candidates[0]->encodeArray(in, len, out + 1, &best);
+    out[0] = ids[0];
+    for (size_t k=1; k<candidates.size(); k++) {
+      uint64_t size = candidates[k]->require(len);
+      trial.resize(size);
+      candidates[k]->encodeArray(in, len, trial.data(), &size);
+      if (size < best) {
+	memcpy(out + 1, trial.data(), size * sizeof(uint32_t));
+	out[0] = ids[k];
+	best = size;
+      }
+    }
+    *nvalue = 1 + best;
+  }
+
+  void decodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t nvalue) const {
+    assert(len);
+    int id = in[0];
+    for (size_t k=0; k<candidates.size(); k++)
+      if (ids[k] == id)
+	return candidates[k]->decodeArray(in + 1, len - 1, out, nvalue);
+    // chosen by an encoder with other candidates
+    createCodec(id)->decodeArray(in + 1, len - 1, out, nvalue);
+  }
+};
@@ -19,24 +19,22 @@
 #pragma once
 
 #include <assert.h>
+#include <string.h>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <optional>
 #include <queue>
 #include <string>
+#include <vector>
 using namespace std;
 
-#include <boost/dynamic_bitset.hpp>
-#include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <boost/program_options/variables_map.hpp>
-using boost::dynamic_bitset;
-using boost::optional;
 namespace prog_options = boost::program_options;
 
 
-#include <integer_encoding.hpp>
-using integer_encoding::EncodingPtr;
+#include "codec.hpp"
 
 
 // space time points
@@ -46,6 +44,9 @@ const Time maxTime = Time(1) << 48;
 typedef uint16_t TId;
 const TId maxTId = -1;
 
+// maximal number of trajectories compressed jointly (--joint)
+const int maxDim = 3;
+
 union STP {
   uint64_t raw;
   struct {
@@ -81,22 +82,33 @@ struct SVI {
 // compressing only one buffer (storing only one size, not copying
 // memory arounds)
 //
+// With dim > 1 every entry is a joint support vector of dim
+// trajectories sharing one dt, stored as dt and dim values v.
+//
 // ATTENTION pointer mangling: uncompressed stores the center of the
 // buffer pointed to by uncompressed_full. Elements are appended by
 // growing in both directions.
+//
+// If the codec separates streams, the dt and v values are compressed
+// as two arrays instead, stored as: uint32_t size of the encoded dt
+// array (in uint32_t), encoded dt array, encoded v array.
 struct SplitSVIBuffer {
 	size_t size, compressed_size; // no. of uint32_t, not bytes!
+	int dim;
 	uint32_t *uncompressed_full,
 		*uncompressed,
 		*compressed;
-	EncodingPtr codec;
+	CodecPtr codec;
 
-	// init with max. number of pairs to store
-	SplitSVIBuffer(EncodingPtr codec, size_t size)
+	// init with max. number of entries to store
+	SplitSVIBuffer(CodecPtr codec, size_t size, int dim = 1)
 		: size(size),
-		  compressed_size(codec->require(2 * size)),
-		  uncompressed_full(new uint32_t[DECODE_REQUIRE_MEM(2 * size)]),
-		  uncompressed(uncompressed_full + size),
+		  compressed_size(codec->separateStreams()
+				  ? 1 + codec->require(size) + codec->require(dim * size)
+				  : codec->require((1 + dim) * size)),
+		  dim(dim),
+		  uncompressed_full(new uint32_t[DECODE_REQUIRE_MEM((1 + dim) * size)]),
+		  uncompressed(uncompressed_full + dim * size),
 		  compressed(new uint32_t[compressed_size]),
 		  codec(codec) {
 	}
@@ -113,15 +125,51 @@ struct SplitSVIBuffer {
 		return res;
 	}
 
+	// joint support vector of dim SVIs (all with the same dt)
+	void set(size_t pos, const SVI *val) {
+		*(uncompressed + pos) = val[0].dt;
+		for (int k=0; k<dim; k++)
+			*(uncompressed - pos * dim - k - 1) = val[k].v;
+	}
+
+	void get(size_t pos, SVI *res) {
+		for (int k=0; k<dim; k++) {
+			res[k].dt = *(uncompressed + pos);
+			res[k].v  = *(uncompressed - pos * dim - k - 1);
+		}
+	}
+
 	// return pointer to buf, buf size in uint32_t
 	tuple<uint32_t*, size_t> encode(size_t numSVI) {
 		auto res_size = compressed_size;
-		codec->encodeArray(uncompressed - numSVI, numSVI * 2, compressed, &res_size);
+		if (codec->separateStreams()) {
+			uint64_t dt_size = compressed_size - 1;
+			codec->encodeArray(uncompressed, numSVI, compressed + 1, &dt_size);
+			compressed[0] = dt_size;
+			res_size = compressed_size - 1 - dt_size;
+			codec->encodeArray(uncompressed - numSVI * dim, numSVI * dim, compressed + 1 + dt_size, &res_size);
+			res_size += 1 + dt_size;
+		}else{
+			codec->encodeArray(uncompressed - numSVI * dim, numSVI * (1 + dim), compressed, &res_size);
+		}
 		return make_tuple(compressed, res_size);
 	}
 
 	void decode(size_t numSVI, size_t csize) {
-		codec->decodeArray(compressed, csize, uncompressed - numSVI, 2 * numSVI);
+		decode(compressed, numSVI, csize);
+	}
+
+	// decode from src (which has to be aligned for uint32_t) instead of compressed
+	void decode(const uint32_t *src, size_t numSVI, size_t csize) {
+		if (codec->separateStreams()) {
+			// v first, a decoder may write beyond its array
+			size_t dt_size = src[0];
+			assert(1 + dt_size <= csize);
+			codec->decodeArray(src + 1 + dt_size, csize - 1 - dt_size, uncompressed - numSVI * dim, dim * numSVI);
+			codec->decodeArray(src + 1, dt_size, uncompressed, numSVI);
+		}else{
+			codec->decodeArray((uint32_t*) src, csize, uncompressed - numSVI * dim, (1 + dim) * numSVI);
+		}
 	}
 
 	~SplitSVIBuffer() {
@@ -136,6 +184,103 @@ struct ChunkSize {
   uint32_t compressed; //   compressed size in bytes
 };
 
+// A chunk with raw size 0 ends an SVI stream (and the whole stream).
+// If it nevertheless has a compressed size it is a side chunk with
+// data that is not part of the SVI stream (e.g. decoder checkpoints)
+// which chunk sources skip.
+inline bool isSideChunk(ChunkSize chunkSize) {
+  return !chunkSize.raw && chunkSize.compressed;
+}
+
+// receives the chunks of a compressed stream
+typedef function<void(char*, ChunkSize)> ChunkSink;
+// Fetches the next chunk of a compressed stream and points data to
+// its payload: either to buf, which the source filled, or to memory
+// of the source (e.g. a mapped file), valid until the next call.
+typedef function<ChunkSize(char *buf, const char *&data)> ChunkSource;
+
+// chunk sink appending to a buffer
+inline ChunkSink appendChunks(vector<char> &buf) {
+  return [&buf](char *data, ChunkSize chunkSize) {
+    buf.insert(buf.end(), (char*) &chunkSize, (char*) &chunkSize + sizeof(chunkSize));
+    buf.insert(buf.end(), data, data + chunkSize.compressed);
+  };
+}
+
+// Output memory for compressed chunks, grown geometrically so that a
+// stream costs O(log(size)) allocations. The memory is malloc()ed, so
+// that release() can hand it to C code that free()s it. A caller that
+// knows the expected size passes it as initial capacity (or provides
+// the malloc()ed memory itself) and usually gets by without growing.
+struct ChunkArena {
+  char *data;
+  size_t size, capacity;
+
+  ChunkArena(size_t capacity = 0, char *data = nullptr)
+    : data(data), size(0), capacity(data ? capacity : 0) {
+    reserve(capacity);
+  }
+
+  void reserve(size_t n) {
+    if (n <= capacity) return;
+    capacity = max(n, 2 * capacity);
+    data = (char*) realloc(data, capacity);
+    assert(data);
+  }
+
+  void append(const void *src, size_t n) {
+    reserve(size + n);
+    memcpy(data + size, src, n);
+    size += n;
+  }
+
+  // hand out the memory (trimmed to size); the arena is empty after
+  char *release() {
+    char *res = (char*) realloc(data, max<size_t>(size, 1));
+    assert(res);
+    data = nullptr;
+    size = capacity = 0;
+    return res;
+  }
+
+  ~ChunkArena() {
+    free(data);
+  }
+};
+
+// chunk sink appending to an arena
+inline ChunkSink appendChunks(ChunkArena &arena) {
+  return [&arena](char *data, ChunkSize chunkSize) {
+    arena.reserve(arena.size + sizeof(chunkSize) + chunkSize.compressed);
+    arena.append(&chunkSize, sizeof(chunkSize));
+    arena.append(data, chunkSize.compressed);
+  };
+}
+
+// Take the next chunk (skipping side chunks) from memory at cur,
+// without copying its payload. Returns an empty chunk at end.
+inline ChunkSize nextChunk(const char *&cur, const char *end, const char *&data) {
+  ChunkSize chunkSize;
+  do {
+    if (cur + sizeof(chunkSize) > end) {
+      chunkSize.raw = chunkSize.compressed = 0;
+      return chunkSize;
+    }
+    memcpy(&chunkSize, cur, sizeof(chunkSize));
+    data = cur + sizeof(chunkSize);
+    cur = data + chunkSize.compressed;
+    assert(cur <= end);
+  } while (isSideChunk(chunkSize));
+  return chunkSize;
+}
+
+// chunk source reading from [begin, end) in place
+inline ChunkSource readChunks(const char *begin, const char *end) {
+  return [=](char*, const char *&data) mutable {
+    return nextChunk(begin, end, data);
+  };
+}
+
 
 template<typename Src, typename Dst>
 Dst bit_convert(Src s) {
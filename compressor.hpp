@@ -18,81 +18,358 @@
 
 #pragma once 
 
+#include "bitpack.hpp"
 #include "common.hpp"
 #include "num_util.hpp"
-
-// state of one trajectory during compression
+#include "schedule.hpp"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+template<typename Real> struct TrajState;
+template<typename Real> struct ExtendKernel;
+
+// State of all trajectories during compression, stored as structure
+// of arrays so that the common case (extending a segment) can be
+// computed for many trajectories per instruction.
+//
+// With dim > 1 the trajectories are grouped into dim consecutive ones
+// (e.g. x, y and z of a particle) that share their segments: a point
+// extends the segments of a group only if it fits for all of them,
+// so they always have the same dt.
+//
+// Quadratic segments x0 + v t + a t^2 (if quadratic) get their
+// acceleration a when they start, predicted from the segments before
+// (see acceleration()); only v is stored, the decompressor predicts
+// the same a. The corridor of v is computed as for linear segments,
+// on x - a t^2.
+//
+// Every trajectory has its own error bound and quantum (see
+// CompressorState).
 template<typename Real>
 struct TrajState {
-  Real x0, x1, vmin, vmax;
-  int64_t qx0; // store the quantized x0 as reference so that
-	       // numerical error of support vector position does not
-	       // accumulate
-  uint32_t dt;
+  TId size;
+  int dim;
+  bool quadratic;
+  Real *error, *quantum;
+  Real *x0, *x1, *vmin, *vmax;
+  int64_t *qx0; // store the quantized x0 as reference so that
+		// numerical error of support vector position does not
+		// accumulate
+  uint32_t *dt;
+  // quadratic only: acceleration of the current segment, dx and dt of
+  // the previous one and the acceleration estimated at its end
+  Real *acc;
+  int64_t *dx0;
+  int32_t *est0;
+  uint32_t *dt0;
+
+  TrajState(TId size, int dim = 1, bool quadratic = false)
+    : size(size),
+      dim(dim),
+      quadratic(quadratic),
+      error(new Real[size]),
+      quantum(new Real[size]),
+      x0(new Real[size]),
+      x1(new Real[size]),
+      vmin(new Real[size]),
+      vmax(new Real[size]),
+      qx0(new int64_t[size]),
+      dt(new uint32_t[size]),
+      acc(new Real[size]),
+      dx0(new int64_t[size]),
+      est0(new int32_t[size]),
+      dt0(new uint32_t[size])
+  {}
 
   // The first point added initialises the data structure.
   // The quantised integer to be stored is returned
-  uint32_t add_first(Real x, Real, Real quantum) {
-    qx0 = quantize(x, quantum);
-    x0 = quant2real<Real>(qx0, quantum),
-    x1 = x,
-    vmin = -numeric_limits<Real>::infinity(),
-    vmax =  numeric_limits<Real>::infinity(),
-    dt = 0;
-
-    return signed2unsigned(quantize(x, quantum));
+  uint32_t add_first(TId i, Real x) {
+    qx0[i] = quantize(x, quantum[i]);
+    x0[i] = quant2real<Real>(qx0[i], quantum[i]),
+    x1[i] = x,
+    vmin[i] = -numeric_limits<Real>::infinity(),
+    vmax[i] =  numeric_limits<Real>::infinity(),
+    dt[i] = 0;
+    acc[i] = 0;
+    dx0[i] = est0[i] = 0;
+    dt0[i] = 0;
+
+    return signed2unsigned(qx0[i]);
+  }
+
+  // Extend the linear segment of every trajectory by its point in
+  // trajVal. Trajectories where the new point does not fit into the
+  // error bound are left untouched and marked in the bit mask
+  // collapsed (one bit per trajectory, ((size + 63) / 64) words);
+  // they have to be passed to restart(). Of a group only the first
+  // trajectory is marked, but all of it has to be restarted.
+  void extend(const Real *trajVal, uint64_t *collapsed) {
+    TId i = 0;
+    for (TId w=0; w<(size + 63) / 64; w++)
+      collapsed[w] = 0;
+    if ((dim > 1) || quadratic) {
+      extendGroups(trajVal, collapsed);
+      return;
+    }
+#ifdef __AVX2__
+    i = ExtendKernel<Real>::run(*this, trajVal, collapsed);
+#endif
+    for (; i<size; i++)
+      if (!extend(i, trajVal[i]))
+	collapsed[i / 64] |= uint64_t(1) << (i % 64);
   }
 
-  optional<SVI> add(Real x, Real e, Real quantum) {
+  // scalar version of extend(); returns false if the point does not
+  // fit into the error bound
+  bool extend(TId i, Real x) {
     // compute new error bound
-    Real vmin2((x - x0 - e) / (dt + 1)),
-         vmax2((x - x0 + e) / (dt + 1));
-    vmin2 = max(vmin, vmin2);
-    vmax2 = min(vmax, vmax2);
-
-    if (vmin2 > vmax2) {
-      // if new point does not fit in the existing error bound, store
-      // a linear segment up to the previous point and start a new
-      // segment
-      SVI res = flush(quantum);
-      // qx0 and x0 are set by flush
-      x1 = x;
-      dt = 1;
-      vmin = x1 - x0 - e;
-      vmax = x1 - x0 + e;
-      return res;
-    }else{
-      // extend the linear segment by the current point otherwise
-      x1 = x;
-      vmin = vmin2;
-      vmax = vmax2;
-      ++dt;
-      return optional<SVI>();
+    Real vmin2((x - x0[i] - error[i]) / (dt[i] + 1)),
+         vmax2((x - x0[i] + error[i]) / (dt[i] + 1));
+    vmin2 = max(vmin[i], vmin2);
+    vmax2 = min(vmax[i], vmax2);
+
+    if (vmin2 > vmax2)
+      return false;
+
+    // extend the linear segment by the current point otherwise
+    x1[i] = x;
+    vmin[i] = vmin2;
+    vmax[i] = vmax2;
+    ++dt[i];
+    return true;
+  }
+
+  // extend() for groups and quadratic segments: the per trajectory
+  // bounds are computed first and only stored if all of the group fit
+  void extendGroups(const Real *trajVal, uint64_t *collapsed) {
+    Real vmin2[maxDim], vmax2[maxDim];
+    for (TId g=0; g<size; g+=dim) {
+      bool fit = true;
+      for (int k=0; k<dim; k++) {
+	TId i = g + k;
+	Real t = dt[i] + 1;
+	Real x = quadratic ? trajVal[i] - acc[i] * t * t : trajVal[i];
+	vmin2[k] = max(vmin[i], (x - x0[i] - error[i]) / t);
+	vmax2[k] = min(vmax[i], (x - x0[i] + error[i]) / t);
+	fit &= !(vmin2[k] > vmax2[k]);
+      }
+      if (!fit) {
+	collapsed[g / 64] |= uint64_t(1) << (g % 64);
+	continue;
+      }
+      for (int k=0; k<dim; k++) {
+	TId i = g + k;
+	x1[i] = trajVal[i];
+	vmin[i] = vmin2[k];
+	vmax[i] = vmax2[k];
+	++dt[i];
+      }
     }
   }
 
-  SVI flush(Real quantum) {
+  // If new point does not fit in the existing error bound, store a
+  // segment up to the previous point and start a new segment
+  SVI restart(TId i, Real x) {
+    SVI res = flush(i);
+    // qx0, x0 and acc are set by flush
+    x1[i] = x;
+    dt[i] = 1;
+    if (quadratic) x -= acc[i];
+    vmin[i] = x - x0[i] - error[i];
+    vmax[i] = x - x0[i] + error[i];
+    return res;
+  }
+
+  optional<SVI> add(TId i, Real x) {
+    if (extend(i, x)) return optional<SVI>();
+    return restart(i, x);
+  }
+
+  SVI flush(TId i) {
     // Compute new support vector: the point sv that is closest to x1
     // while maintaining the derivate bounds vmin/vmax
-    Real sv;
-    if      (x1 - x0 < vmin * dt) { sv = x0 + vmin * dt; }
-    else if (x1 - x0 > vmax * dt) { sv = x0 + vmax * dt; }
-    else                          { sv = x1; }
+    Real sv, bend = quadratic ? acc[i] * dt[i] * dt[i] : 0;
+    Real x = x1[i] - bend;
+    if      (x - x0[i] < vmin[i] * dt[i]) { sv = x0[i] + vmin[i] * dt[i]; }
+    else if (x - x0[i] > vmax[i] * dt[i]) { sv = x0[i] + vmax[i] * dt[i]; }
+    else                                  { sv = x; }
+    sv += bend;
 
     // create integer support vector (the data struct to VLI-compress)
     SVI svi;
-    assert(dt > 0);
-    svi.dt = dt - 1;
-    svi.v = signed2unsigned(quantize(sv - x0, quantum));
-
-    // start new segment from sv, not from x1
-    qx0 = quantize(sv, quantum);
-    x0 = quant2real<Real>(qx0, quantum);
+    assert(dt[i] > 0);
+    svi.dt = dt[i] - 1;
+    auto dx = quantize(sv - x0[i], quantum[i]);
+    svi.v = signed2unsigned(dx);
+
+    // start new segment from sv, not from x1; advance qx0 by exactly
+    // what the decoder adds, so that both agree on x0 even where
+    // rounding sv and sv - x0 differs (frequent with float)
+    qx0[i] += dx;
+    x0[i] = quant2real<Real>(qx0[i], quantum[i]);
+
+    if (quadratic) {
+      int32_t est = accelerationEstimate(dx0[i], dt0[i], dx, dt[i]);
+      acc[i] = quant2real<Real>(acceleration(est0[i], est), quantum[i] / accelerationScale);
+      dx0[i] = dx;
+      dt0[i] = dt[i];
+      est0[i] = est;
+    }
 
     return svi;
   }
+
+  ~TrajState() {
+    delete[] error;
+    delete[] quantum;
+    delete[] x0;
+    delete[] x1;
+    delete[] vmin;
+    delete[] vmax;
+    delete[] qx0;
+    delete[] dt;
+    delete[] acc;
+    delete[] dx0;
+    delete[] est0;
+    delete[] dt0;
+  }
+};
+
+// Vectorized TrajState::extend(). run() processes a prefix of all
+// trajectories and returns its length; the remainder is done by the
+// scalar code. max/min are computed via compare + blend to match the
+// semantics (and thus the output bytes) of std::max/std::min.
+#if defined(__AVX512F__)
+
+template<>
+struct ExtendKernel<double> {
+  static TId run(TrajState<double> &s, const double *trajVal, uint64_t *collapsed) {
+    const TId width = 8;
+    TId i = 0;
+    for (; i + width <= s.size; i += width) {
+      __m256i dt    = _mm256_loadu_si256((__m256i*) (s.dt + i));
+      __m512d x     = _mm512_loadu_pd(trajVal + i),
+	      dx    = _mm512_sub_pd(x, _mm512_loadu_pd(s.x0 + i)),
+	      dt1   = _mm512_cvtepi32_pd(_mm256_add_epi32(dt, _mm256_set1_epi32(1))),
+	      vmin  = _mm512_loadu_pd(s.vmin + i),
+	      vmax  = _mm512_loadu_pd(s.vmax + i),
+	      ve    = _mm512_loadu_pd(s.error + i),
+	      vmin2 = _mm512_div_pd(_mm512_sub_pd(dx, ve), dt1),
+	      vmax2 = _mm512_div_pd(_mm512_add_pd(dx, ve), dt1);
+      vmin2 = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(vmin, vmin2, _CMP_LT_OQ), vmin, vmin2);
+      vmax2 = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(vmax2, vmax, _CMP_LT_OQ), vmax, vmax2);
+      __mmask8 fail = _mm512_cmp_pd_mask(vmin2, vmax2, _CMP_GT_OQ),
+	       ok   = ~fail;
+      _mm512_mask_storeu_pd(s.x1   + i, ok, x);
+      _mm512_mask_storeu_pd(s.vmin + i, ok, vmin2);
+      _mm512_mask_storeu_pd(s.vmax + i, ok, vmax2);
+      _mm256_storeu_si256((__m256i*) (s.dt + i),
+			  _mm256_add_epi32(dt, _mm512_castsi512_si256(_mm512_maskz_set1_epi32(ok, 1))));
+      collapsed[i / 64] |= uint64_t(fail) << (i % 64);
+    }
+    return i;
+  }
+};
+
+template<>
+struct ExtendKernel<float> {
+  static TId run(TrajState<float> &s, const float *trajVal, uint64_t *collapsed) {
+    const TId width = 16;
+    TId i = 0;
+    for (; i + width <= s.size; i += width) {
+      __m512i dt    = _mm512_loadu_si512((__m512i*) (s.dt + i));
+      __m512  x     = _mm512_loadu_ps(trajVal + i),
+	      dx    = _mm512_sub_ps(x, _mm512_loadu_ps(s.x0 + i)),
+	      dt1   = _mm512_cvtepi32_ps(_mm512_add_epi32(dt, _mm512_set1_epi32(1))),
+	      vmin  = _mm512_loadu_ps(s.vmin + i),
+	      vmax  = _mm512_loadu_ps(s.vmax + i),
+	      ve    = _mm512_loadu_ps(s.error + i),
+	      vmin2 = _mm512_div_ps(_mm512_sub_ps(dx, ve), dt1),
+	      vmax2 = _mm512_div_ps(_mm512_add_ps(dx, ve), dt1);
+      vmin2 = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(vmin, vmin2, _CMP_LT_OQ), vmin, vmin2);
+      vmax2 = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(vmax2, vmax, _CMP_LT_OQ), vmax, vmax2);
+      __mmask16 fail = _mm512_cmp_ps_mask(vmin2, vmax2, _CMP_GT_OQ),
+		ok   = ~fail;
+      _mm512_mask_storeu_ps(s.x1   + i, ok, x);
+      _mm512_mask_storeu_ps(s.vmin + i, ok, vmin2);
+      _mm512_mask_storeu_ps(s.vmax + i, ok, vmax2);
+      _mm512_storeu_si512((__m512i*) (s.dt + i),
+			  _mm512_mask_add_epi32(dt, ok, dt, _mm512_set1_epi32(1)));
+      collapsed[i / 64] |= uint64_t(fail) << (i % 64);
+    }
+    return i;
+  }
+};
+
+#elif defined(__AVX2__)
+
+template<>
+struct ExtendKernel<double> {
+  static TId run(TrajState<double> &s, const double *trajVal, uint64_t *collapsed) {
+    const TId width = 4;
+    TId i = 0;
+    for (; i + width <= s.size; i += width) {
+      __m128i dt    = _mm_loadu_si128((__m128i*) (s.dt + i));
+      __m256d x     = _mm256_loadu_pd(trajVal + i),
+	      x1    = _mm256_loadu_pd(s.x1 + i),
+	      dx    = _mm256_sub_pd(x, _mm256_loadu_pd(s.x0 + i)),
+	      dt1   = _mm256_cvtepi32_pd(_mm_add_epi32(dt, _mm_set1_epi32(1))),
+	      vmin  = _mm256_loadu_pd(s.vmin + i),
+	      vmax  = _mm256_loadu_pd(s.vmax + i),
+	      ve    = _mm256_loadu_pd(s.error + i),
+	      vmin2 = _mm256_div_pd(_mm256_sub_pd(dx, ve), dt1),
+	      vmax2 = _mm256_div_pd(_mm256_add_pd(dx, ve), dt1);
+      vmin2 = _mm256_blendv_pd(vmin, vmin2, _mm256_cmp_pd(vmin, vmin2, _CMP_LT_OQ));
+      vmax2 = _mm256_blendv_pd(vmax, vmax2, _mm256_cmp_pd(vmax2, vmax, _CMP_LT_OQ));
+      __m256d fail = _mm256_cmp_pd(vmin2, vmax2, _CMP_GT_OQ);
+      // the low halves of the 64 bit lanes form a 32 bit lane mask
+      __m128i fail32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+	_mm256_castpd_si256(fail), _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+      _mm256_storeu_pd(s.x1   + i, _mm256_blendv_pd(x,     x1,   fail));
+      _mm256_storeu_pd(s.vmin + i, _mm256_blendv_pd(vmin2, vmin, fail));
+      _mm256_storeu_pd(s.vmax + i, _mm256_blendv_pd(vmax2, vmax, fail));
+      _mm_storeu_si128((__m128i*) (s.dt + i),
+		       _mm_add_epi32(dt, _mm_andnot_si128(fail32, _mm_set1_epi32(1))));
+      collapsed[i / 64] |= uint64_t(_mm256_movemask_pd(fail)) << (i % 64);
+    }
+    return i;
+  }
+};
+
+template<>
+struct ExtendKernel<float> {
+  static TId run(TrajState<float> &s, const float *trajVal, uint64_t *collapsed) {
+    const TId width = 8;
+    TId i = 0;
+    for (; i + width <= s.size; i += width) {
+      __m256i dt    = _mm256_loadu_si256((__m256i*) (s.dt + i));
+      __m256  x     = _mm256_loadu_ps(trajVal + i),
+	      x1    = _mm256_loadu_ps(s.x1 + i),
+	      dx    = _mm256_sub_ps(x, _mm256_loadu_ps(s.x0 + i)),
+	      dt1   = _mm256_cvtepi32_ps(_mm256_add_epi32(dt, _mm256_set1_epi32(1))),
+	      vmin  = _mm256_loadu_ps(s.vmin + i),
+	      vmax  = _mm256_loadu_ps(s.vmax + i),
+	      ve    = _mm256_loadu_ps(s.error + i),
+	      vmin2 = _mm256_div_ps(_mm256_sub_ps(dx, ve), dt1),
+	      vmax2 = _mm256_div_ps(_mm256_add_ps(dx, ve), dt1);
+      vmin2 = _mm256_blendv_ps(vmin, vmin2, _mm256_cmp_ps(vmin, vmin2, _CMP_LT_OQ));
+      vmax2 = _mm256_blendv_ps(vmax, vmax2, _mm256_cmp_ps(vmax2, vmax, _CMP_LT_OQ));
+      __m256 fail = _mm256_cmp_ps(vmin2, vmax2, _CMP_GT_OQ);
+      _mm256_storeu_ps(s.x1   + i, _mm256_blendv_ps(x,     x1,   fail));
+      _mm256_storeu_ps(s.vmin + i, _mm256_blendv_ps(vmin2, vmin, fail));
+      _mm256_storeu_ps(s.vmax + i, _mm256_blendv_ps(vmax2, vmax, fail));
+      _mm256_storeu_si256((__m256i*) (s.dt + i),
+			  _mm256_add_epi32(dt, _mm256_andnot_si256(_mm256_castps_si256(fail), _mm256_set1_epi32(1))));
+      collapsed[i / 64] |= uint64_t(_mm256_movemask_ps(fail)) << (i % 64);
+    }
+    return i;
+  }
 };
 
+#endif
+
 // state of the compressor
 template<typename Real>
 struct CompressorState {
@@ -103,111 +380,123 @@ struct CompressorState {
   // Output config
   int chunkSize; // maximal number of support vectors (SVI)
 
+  // trajectories per group sharing their segments (see TrajState)
+  int dim;
+
   // Store the order in which support vectors are expected and in
   // which we know them respectively. Only the later might store more
-  // than one support vector for a trajectory
-  priority_queue<STP, priority_queue<STP>::container_type, std::greater<STP>> expectedSegment;
-  map<STP, SVI> knownSegment;
+  // than one support vector for a trajectory. Groups are scheduled
+  // under the id traj / dim.
+  SegmentSchedule schedule;
   Time curTime;
 
-  TrajState<Real> *trajState;
+  TrajState<Real> trajState;
+  uint64_t *collapsed; // bit mask of trajectories, see TrajState::extend
 
   // Current chunk of support vectors to be written
   int curSV;
 	SplitSVIBuffer buf;
 
   // function which is called with the compressedSV
-  function<void(char*, ChunkSize)> sink;
+  ChunkSink sink;
+
+  // packed key frame
+  vector<uint32_t> keyFrame;
 
   /// the functions of the compressor in order
 
-  // 0. init compressor
+  // 0. init compressor; scale (if given) holds a factor on error and
+  // quantum for every trajectory (error classes, see --error-class)
   CompressorState(TId numTraj, Real error, Real bound, Real quantum,
-		  int chunkSize, EncodingPtr encoder,
-		  function<void(char*, ChunkSize)> sink) 
+		  int chunkSize, CodecPtr encoder,
+		  ChunkSink sink, int dim = 1, bool quadratic = false,
+		  const double *scale = nullptr)
   : numTraj(numTraj),
     error(error),
     bound(bound),
     quantum(quantum),
     chunkSize(chunkSize),
+    dim(dim),
+    schedule(numTraj / dim),
     curTime(0),
-    trajState(new TrajState<Real>[numTraj]),
+    trajState(numTraj, dim, quadratic),
+    collapsed(new uint64_t[(numTraj + 63) / 64]),
     curSV(0),
-    buf(encoder, chunkSize),
+    buf(encoder, chunkSize, dim),
     sink(sink)
-  {}
+  {
+    assert((dim >= 1) && (dim <= maxDim) && !(numTraj % dim));
+    for (TId i=0; i<numTraj; i++) {
+      trajState.error[i]   = scale ? error   * scale[i] : error;
+      trajState.quantum[i] = scale ? quantum * scale[i] : quantum;
+    }
+  }
 
   // 1. add another frame of trajectory data
-  void addFrame(Real *trajVal) {
+  void addFrame(const Real *trajVal) {
     if (curTime) { addLaterFrame(trajVal); }
     else         { addFirstFrame(trajVal); }
   }
 
   // Use the first frame for late initialization of TrajState and
   // expected segment queue.
-  void addFirstFrame(Real *trajVal) {
+  void addFirstFrame(const Real *trajVal) {
     // Instead of compressed support vectors, initial value (x) is
     // stored uncompressed with the minimal number of bits given bound
-    // and quantum (+1 for sign)
-    uint bit_count = 2 + ceil(log2(bound / quantum));
-    dynamic_bitset<uint8_t> iv(bit_count * numTraj);
+    // and the finest quantum (+1 for sign)
+    Real minQuantum = *min_element(trajState.quantum, trajState.quantum + numTraj);
+    uint bit_count = 2 + ceil(log2(bound / minQuantum));
+    assert(bit_count <= 32);
+    keyFrame.resize((packedBytes(numTraj, bit_count) + 3) / 4);
+    BitPacker iv(keyFrame.data());
     for (int traj=0; traj<numTraj; traj++) {
       auto x = trajVal[traj];
-      auto x_quant = trajState[traj].add_first(x, error, quantum);
-      assert(x_quant < (decltype(x_quant)(1) << (bit_count-1)));
-      for (uint i=0; i<bit_count; i++)
-	      iv[traj * bit_count + i] = (x_quant >> i) & 1;
+      auto x_quant = trajState.add_first(traj, x);
+      assert(x_quant < (uint64_t(1) << (bit_count-1)));
+      iv.put(x_quant, bit_count);
     }
+    iv.flush();
 
-    // write data to stream
-    // TODO: use buffer of interal representation of dynamic_bitset
+    // write data to stream, padded to whole words so that the SVI
+    // chunks behind it stay 4-byte aligned
     ChunkSize sz;
     sz.raw = bit_count * numTraj;
-    sz.compressed = (sz.raw + 7) / 8;
-    uint8_t *raw_iv = new uint8_t[sz.compressed];
-    to_block_range(iv, raw_iv);
-    sink((char*) raw_iv, sz);
-    delete[] raw_iv;
+    sz.compressed = keyFrame.size() * sizeof(uint32_t);
+    sink((char*) keyFrame.data(), sz);
 
     // Add all expected segments
     curTime = 1;
-    for (int traj=0; traj<numTraj; traj++) {
+    for (int g=0; g<numTraj / dim; g++) {
       STP stp;
       stp.time = curTime;
-      stp.id = traj;
-      expectedSegment.push(stp);
+      stp.id = g;
+      schedule.expect(stp);
     }
   }
 
-  void addLaterFrame(Real *trajVal) {
-    for (int traj=0; traj<numTraj; traj++) {
-      auto x = trajVal[traj];
+  void addLaterFrame(const Real *trajVal) {
+    // test new points against all particles trajectories; only those
+    // that do not fit take the scalar path below
+    trajState.extend(trajVal, collapsed);
+
+    for (int w=0; w<(numTraj + 63) / 64; w++) {
+      for (uint64_t bits = collapsed[w]; bits; bits &= bits - 1) {
+	TId traj = w * 64 + __builtin_ctzll(bits);
 
-      // test new point against particles trajectory
-      auto maybePoint = trajState[traj].add(x, error, quantum);
-      if (maybePoint) {
 	// add point to known support vectors
-	STP stp;
-	stp.time = curTime - (maybePoint->dt + 1);
-	stp.id = traj;
-	knownSegment.insert(make_pair(stp, *maybePoint));
-	
+	for (int k=0; k<dim; k++)
+	  schedule.know(traj / dim, trajState.restart(traj + k, trajVal[traj + k]));
+
 	// Test if we know the next required support vector. Add it to
 	// the raw chunk if so. Push the chunk once it is full.
-	while (expectedSegment.size() && (expectedSegment.top() == knownSegment.begin()->first)) {
-	  auto segIter = knownSegment.begin();
-	  auto expectedTraj = expectedSegment.top().id;
-
-	  // add new expected segemnt
-	  STP newSeg;
-	  newSeg.time = segIter->first.time + segIter->second.dt + 1;
-	  newSeg.id = expectedTraj;
-	  expectedSegment.push(newSeg);
-
-	  // write out known segment
-	  buf.set(curSV++, segIter->second);
-	  knownSegment.erase(segIter);
-	  expectedSegment.pop();
+	while (schedule.ready()) {
+	  if (dim == 1) {
+	    buf.set(curSV++, schedule.next());
+	  }else{
+	    SVI svi[maxDim] = {};
+	    schedule.next(svi, dim);
+	    buf.set(curSV++, svi);
+	  }
 
 	  // write out chunk once full
 	  if (curSV >= chunkSize)
@@ -223,7 +512,7 @@ struct CompressorState {
   void pushChunk() {
 	  uint32_t *cbuf;
     ChunkSize sz;
-    sz.raw = curSV * 2 * 4;  // two 4-byte int per support vector
+    sz.raw = curSV * (1 + dim) * 4;  // dt and dim v, 4-byte int each
     if (curSV) {
       tie(cbuf, sz.compressed) = buf.encode(curSV);
       sz.compressed *= sizeof(uint32_t);
@@ -241,28 +530,24 @@ struct CompressorState {
     // have been seen. Only then we need to flush the unfinished
     // trajectories.
     if (curTime > 1) {
-      for (; expectedSegment.size(); expectedSegment.pop()) {
-	      auto es  = expectedSegment.top();
-	      auto fks = knownSegment.begin();
+      while (!schedule.empty()) {
+	      auto es = schedule.top();
 	      assert(es.time < curTime);
 	      // If we already have a support vector for the point, use it;
-	      // otherwise we have to create one by flushing it
-	      if ((fks != knownSegment.end()) & (es == fks->first)) {
-		      // Construct the next segment to wait for. Note:
-		      // - An SVI is only known if it terminates before curTime.
-		      // - There may be more than one pending SVI for each
-		      //   trajectory.
-		      STP newSeg;
-		      newSeg.time = fks->first.time + fks->second.dt + 1;
-		      newSeg.id   = fks->first.id;
-		      assert(newSeg.time < curTime);
-		      expectedSegment.push(newSeg);
-		      
-		      buf.set(curSV++, fks->second);
-		      knownSegment.erase(fks);
+	      // otherwise we have to create one by flushing it. Note:
+	      // - An SVI is only known if it terminates before curTime.
+	      // - There may be more than one pending SVI for each
+	      //   trajectory.
+	      SVI svi[maxDim] = {};
+	      if (schedule.known(es.id)) {
+		      schedule.next(svi, dim);
+		      assert(es.time + svi[0].dt + 1 < curTime);
 	      }else{
-		      buf.set(curSV++, trajState[es.id].flush(quantum));
+		      schedule.drop();
+		      for (int k=0; k<dim; k++)
+			      svi[k] = trajState.flush(es.id * dim + k);
 	      }
+	      buf.set(curSV++, svi);
 	      if (curSV >= chunkSize) pushChunk();
       }
     }
@@ -273,6 +558,6 @@ struct CompressorState {
   }
 
   ~CompressorState() {
-    delete[] trajState;
+    delete[] collapsed;
   }
 };
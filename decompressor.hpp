@@ -18,55 +18,155 @@
 
 #pragma once 
 
+#include "bitpack.hpp"
 #include "common.hpp"
 #include "num_util.hpp"
 
+// State of all trajectories during decompression, stored as structure
+// of arrays. Besides the current segment as read from the stream (its
+// end t1 = t0 + dt, dt, x0, dx) it caches the segment's end value and
+// slope, so that reconstructing a frame costs one multiply-add per
+// trajectory instead of a division.
+//
+// Quadratic segments (see TrajState) additionally have their
+// acceleration (qacc quantized), and slope is the one at the end. The
+// acceleration of the next segment is predicted from dx and dt of the
+// current and the previous segment (dx0, dt0) and the estimate est0
+// made at the end of the previous one.
+template<typename Real>
 struct DecompTrajState {
-  Time t0, dt;
-  int x0, dx;
-
-  template<typename Real>
-  Real get(Time t1, Real quantum) {
-    return dt 
-      ?                   quant2real<Real>(x0, quantum)
-        + Real(t1 - t0) * quant2real<Real>(dx, quantum) / dt
-      : quant2real<Real>(x0, quantum);
+  TId size;
+  bool quadratic;
+  uint32_t *t1, *dt, *dt0;
+  int32_t *x0, *dx, *qacc, *dx0, *est0;
+  Real *end, *slope, *acc;
+
+  DecompTrajState(TId size, bool quadratic = false)
+    : size(size),
+      quadratic(quadratic),
+      t1(new uint32_t[size]),
+      dt(new uint32_t[size]),
+      dt0(new uint32_t[size]),
+      x0(new int32_t[size]),
+      dx(new int32_t[size]),
+      qacc(new int32_t[size]),
+      dx0(new int32_t[size]),
+      est0(new int32_t[size]),
+      end(new Real[size]),
+      slope(new Real[size]),
+      acc(new Real[size])
+  {}
+
+  void set(TId i, uint32_t t0_, uint32_t dt_, int32_t x0_, int32_t dx_, Real quantum,
+	   int32_t qacc_ = 0) {
+    t1[i] = t0_ + dt_;
+    dt[i] = dt_;
+    x0[i] = x0_;
+    dx[i] = dx_;
+    qacc[i] = qacc_;
+    end[i]   = quant2real<Real>(x0_ + dx_, quantum);
+    slope[i] = dt_ ? quant2real<Real>(dx_, quantum) / dt_ : 0;
+    acc[i]   = quant2real<Real>(qacc_, quantum / accelerationScale);
+    // x0 + v t + a t^2 passes the end with slope v + 2 a dt, where
+    // v = dx / dt - a dt
+    if (quadratic) slope[i] += acc[i] * dt_;
+  }
+
+  // quadratic only: the acceleration of the segment following the
+  // current one of i, as TrajState::flush predicts it
+  int32_t predict(TId i) {
+    int32_t est = accelerationEstimate(dx0[i], dt0[i], dx[i], dt[i]);
+    int32_t a = acceleration(est0[i], est);
+    dx0[i] = dx[i];
+    dt0[i] = dt[i];
+    est0[i] = est;
+    return a;
+  }
+
+  uint32_t t0(TId i) const { return t1[i] - dt[i]; }
+
+  // Reconstruct all trajectories at time t. A segment covers the
+  // frames t0+1 .. t1, so each value is computed back from the segment
+  // end: support points come out exact, rounding errors do not
+  // accumulate and the result does not depend on the frame decoding
+  // started at. The loop is left to the auto-vectorizer.
+  void get(Time t, Real *dst) const {
+    uint32_t t32 = t;
+    if (quadratic) {
+      for (TId i=0; i<size; i++) {
+	Real s = Real(int32_t(t1[i] - t32));
+	dst[i] = end[i] - s * slope[i] + s * s * acc[i];
+      }
+      return;
+    }
+    for (TId i=0; i<size; i++)
+      dst[i] = end[i] - Real(int32_t(t1[i] - t32)) * slope[i];
+  }
+
+  ~DecompTrajState() {
+    delete[] t1;
+    delete[] dt;
+    delete[] dt0;
+    delete[] x0;
+    delete[] dx;
+    delete[] qacc;
+    delete[] dx0;
+    delete[] est0;
+    delete[] end;
+    delete[] slope;
+    delete[] acc;
   }
 };
 
+// Decodes a stream of CompressorState; dim and quadratic have to be
+// the same. The expected segments are those of the groups (traj / dim).
 template<typename Real>
 struct DecompressorState {
   TId numTraj;
-  Real quantum;
+  vector<Real> quantum; // of every trajectory
+  int dim;
+  bool quadratic;
 
-  DecompTrajState *trajState;
+  DecompTrajState<Real> trajState;
   priority_queue<STP, priority_queue<STP>::container_type, std::greater<STP>> expectedSegment;
   Time curTime;
 
 	SplitSVIBuffer buf;
   uint64_t chunkSz, chunkCur;
 
-  function<ChunkSize(char*)> chunkSrc;
-  EncodingPtr decoder;
+  ChunkSource chunkSrc;
+  CodecPtr decoder;
+
+  // read buffer of the key frame
+  vector<uint32_t> keyFrame;
 
   // statistic helpers
 #ifdef HACKY_STATS
   map<int, uint> stat_key_x, stat_dx, stat_dt;
 #endif
 
+  // scale as for CompressorState
   DecompressorState(TId numTraj, Real quantum,
-		    uint64_t maxChunkSize, EncodingPtr decoder,
-		    function<ChunkSize(char*)> chunkSrc)
+		    uint64_t maxChunkSize, CodecPtr decoder,
+		    ChunkSource chunkSrc, int dim = 1, bool quadratic = false,
+		    const double *scale = nullptr)
   : numTraj(numTraj),
-    quantum(quantum),
-    trajState(new DecompTrajState[numTraj]),
+    quantum(numTraj, quantum),
+    dim(dim),
+    quadratic(quadratic),
+    trajState(numTraj, quadratic),
     curTime(0),
-    buf(decoder, maxChunkSize),
+    buf(decoder, maxChunkSize, dim),
     chunkSz(0),
     chunkCur(0),
     chunkSrc(chunkSrc),
     decoder(decoder)
-  {}
+  {
+    assert((dim >= 1) && (dim <= maxDim) && !(numTraj % dim));
+    if (scale)
+      for (TId i=0; i<numTraj; i++)
+	this->quantum[i] = quantum * scale[i];
+  }
 
   bool readFrame(Real *trajDst) {
     if (!curTime)
@@ -76,42 +176,97 @@ struct DecompressorState {
     if (expectedSegment.top().time <= curTime)
       return false;
     // push data to trajDst
-    if (trajDst) {
-      for (int i=0; i<numTraj; i++)
-	trajDst[i] = trajState[i].get<Real>(curTime, quantum);
-    }
+    if (trajDst)
+      trajState.get(curTime, trajDst);
     curTime++;
     return true;
   }
 
+  // Advance by n frames without reconstructing them. Returns false if
+  // the block ends before.
+  bool skipFrames(Time n) {
+    for (; n; n--)
+      if (!readFrame(nullptr)) return false;
+    return true;
+  }
+
+  // The complete decoder state in between two frames (curTime > 0),
+  // except for the current SVI chunk which is reloaded from the
+  // stream. The words of trajectory i (four, eight if quadratic) are
+  // stored at i, numTraj + i, ... to help the integer encoder.
+  size_t stateSize() const { return (quadratic ? 8 : 4) * size_t(numTraj); }
+
+  void saveState(uint32_t *state) const {
+    assert(curTime);
+    for (int i=0; i<numTraj; i++) {
+      state[i]             = curTime - 1 - trajState.t0(i);
+      state[numTraj + i]   = trajState.dt[i];
+      state[2*numTraj + i] = signed2unsigned(trajState.x0[i]);
+      state[3*numTraj + i] = signed2unsigned(trajState.dx[i]);
+      if (!quadratic) continue;
+      state[4*numTraj + i] = signed2unsigned(trajState.qacc[i]);
+      state[5*numTraj + i] = trajState.dt0[i];
+      state[6*numTraj + i] = signed2unsigned(trajState.dx0[i]);
+      state[7*numTraj + i] = signed2unsigned(trajState.est0[i]);
+    }
+  }
+
+  // Restore a state saved before reading frame t. The chunk source
+  // has to deliver the SVI chunk that was current then; cur SVIs of it
+  // are skipped.
+  void restoreState(Time t, const uint32_t *state, uint64_t cur) {
+    curTime = t;
+    expectedSegment = decltype(expectedSegment)();
+    for (int i=0; i<numTraj; i++) {
+      trajState.set(i, curTime - 1 - state[i], state[numTraj + i],
+		    unsigned2signed(state[2*numTraj + i]),
+		    unsigned2signed(state[3*numTraj + i]), quantum[i],
+		    quadratic ? unsigned2signed(state[4*numTraj + i]) : 0);
+      if (quadratic) {
+	trajState.dt0[i]  = state[5*numTraj + i];
+	trajState.dx0[i]  = unsigned2signed(state[6*numTraj + i]);
+	trajState.est0[i] = unsigned2signed(state[7*numTraj + i]);
+      }
+
+      if (i % dim) continue;
+      STP stp;
+      stp.id = i / dim;
+      stp.time = trajState.t1[i] + 1;
+      expectedSegment.push(stp);
+    }
+    loadNextChunk();
+    assert(cur <= chunkSz);
+    chunkCur = cur;
+  }
+
   bool readKeyFrame() {
     // init expected segements
-    uint8_t *raw_iv = new uint8_t[numTraj * sizeof(Real)];
-    ChunkSize sz = chunkSrc((char*) raw_iv);
-    if (!sz.raw) return false;
+    keyFrame.resize(numTraj);
+    const char *data;
+    ChunkSize sz = chunkSrc((char*) keyFrame.data(), data);
+    if (!sz.raw)
+      return false;
     uint bit_count = sz.raw / numTraj;
-    assert(bit_count * numTraj == sz.raw);
-    dynamic_bitset<uint8_t> iv(raw_iv, raw_iv + sz.compressed);
-    delete[] raw_iv;
+    assert((bit_count * numTraj == sz.raw) && (bit_count <= 32));
+    // padded to whole words (or not, in older streams)
+    assert((sz.compressed >= packedBytes(numTraj, bit_count)) && (sz.compressed < packedBytes(numTraj, bit_count) + 4));
+    BitUnpacker iv(data, sz.compressed);
 
     for (int i=0; i<numTraj; i++) {
-      uint32_t x_quant = 0;
-      for (uint j=0; j<bit_count; j++)
-	    x_quant |= decltype(x_quant)(iv[i * bit_count + j]) << j;
+      uint32_t x_quant = iv.get(bit_count);
 
-      STP stp;
-      stp.id = i;
-      stp.time = 1;
-      expectedSegment.push(stp);
+      if (!(i % dim)) {
+	STP stp;
+	stp.id = i / dim;
+	stp.time = 1;
+	expectedSegment.push(stp);
+      }
       
-      DecompTrajState &traj = trajState[i];
-      traj.t0 = 0;
-      traj.x0 = unsigned2signed(x_quant);
-      traj.dt = 0;
-      traj.dx = 0;
+      trajState.set(i, 0, 0, unsigned2signed(x_quant), 0, quantum[i]);
+      trajState.dt0[i] = trajState.dx0[i] = trajState.est0[i] = 0;
 
 #ifdef HACKY_STATS
-      stat_key_x[traj.x0]++;
+      stat_key_x[trajState.x0[i]]++;
 #endif
     }
     loadNextChunk();
@@ -121,25 +276,29 @@ struct DecompressorState {
   void readSegment() {
     assert(chunkCur < chunkSz);
     
-    // update mentioned traj
+    // update mentioned traj (or all of its group)
     TId id = expectedSegment.top().id;
-    SVI svi = buf.get(chunkCur);
-    DecompTrajState &traj = trajState[id];
-    traj.x0 += traj.dx;
-    traj.t0 += traj.dt; assert(traj.t0 == curTime-1);
-    traj.dt  = svi.dt + 1;
-    traj.dx  = unsigned2signed(svi.v);
+    SVI svi[maxDim];
+    buf.get(chunkCur, svi);
+    for (int k=0; k<dim; k++) {
+      TId i = id * dim + k;
+      assert(trajState.t1[i] == curTime-1);
+      int32_t qacc = quadratic ? trajState.predict(i) : 0;
+      trajState.set(i, curTime - 1, svi[k].dt + 1,
+		    trajState.x0[i] + trajState.dx[i], unsigned2signed(svi[k].v), quantum[i],
+		    qacc);
+    }
 
     // gather histogram data
 #ifdef HACKY_STATS
-    stat_dx[traj.dx]++;
-    stat_dt[traj.dt]++;
+    stat_dx[trajState.dx[id * dim]]++;
+    stat_dt[trajState.dt[id * dim]]++;
 #endif
     
     // add next expected point
     STP stp;
     stp.id = id;
-    stp.time = curTime + traj.dt;
+    stp.time = curTime + trajState.dt[id * dim];
     expectedSegment.pop();
     expectedSegment.push(stp);
     
@@ -151,18 +310,24 @@ struct DecompressorState {
   }
 
   void loadNextChunk() {
-	  ChunkSize sz = chunkSrc((char*) buf.compressed); 
+    const char *data;
+    ChunkSize sz = chunkSrc((char*) buf.compressed, data);
     chunkCur = 0;
-    chunkSz = sz.raw / 2 / 4;
+    chunkSz = sz.raw / (1 + dim) / 4;
     if (chunkSz) {
-	    buf.decode(chunkSz, sz.compressed / 4);
+      // decode in place if the source handed out aligned memory
+      // (always for mapped streams, except those written before key
+      // frames were padded)
+      if (uintptr_t(data) % alignof(uint32_t)) {
+	memcpy(buf.compressed, data, sz.compressed);
+	data = (char*) buf.compressed;
+      }
+      buf.decode((const uint32_t*) data, chunkSz, sz.compressed / 4);
     }
     // NOTE: chunkCur == chunkSz is used to signal a failed load
   }
 
   ~DecompressorState() {
-    delete[] trajState;
-
 #ifdef HACKY_STATS
 		for (auto stat : {make_tuple(stat_key_x, "stat_key_x"),
 					make_tuple(stat_dx, "stat_dx"),
@@ -18,8 +18,16 @@
 
 #pragma once
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <charconv>
+#include <memory>
+#include <type_traits>
+
+#include "header.hpp"
+#include "parallel.hpp"
 
 bool readAll(int fd, char *buf, size_t size) {
   size_t cur = 0;
@@ -33,57 +41,437 @@ bool readAll(int fd, char *buf, size_t size) {
   return true;
 }
 
-template<typename Real>
+bool writeAll(int fd, const char *buf, size_t size) {
+  size_t cur = 0;
+  while (cur < size) {
+    auto ret = write(fd, buf+cur, size-cur);
+    if (ret < 0) return false;
+    cur += ret;
+  }
+  return true;
+}
+
+// discard size bytes of a (possibly unseekable) input
+bool skipAll(int fd, size_t size) {
+  char buf[4096];
+  while (size) {
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    if (!readAll(fd, buf, n)) return false;
+    size -= n;
+  }
+  return true;
+}
+
+// Read the chunks of one unsharded block (key frame up to the empty
+// chunk ending its SVI stream) into block, dropping side chunks.
+// Returns false at the end of the stream.
+bool readBlock(int fd, vector<char> &block) {
+  block.clear();
+  ChunkSize chunkSize;
+  for (;;) {
+    if (!readAll(fd, (char*) &chunkSize, sizeof(chunkSize))) {
+      assert(block.empty()); // truncated block
+      return false;
+    }
+    if (isSideChunk(chunkSize)) {
+      assert(skipAll(fd, chunkSize.compressed));
+      continue;
+    }
+    // an empty chunk in place of a key frame marks the end
+    if (block.empty() && !chunkSize.raw) return false;
+    size_t pos = block.size();
+    block.resize(pos + sizeof(chunkSize) + chunkSize.compressed);
+    memcpy(block.data() + pos, &chunkSize, sizeof(chunkSize));
+    assert(readAll(fd, block.data() + pos + sizeof(chunkSize), chunkSize.compressed));
+    if (!chunkSize.raw) return true;
+  }
+}
+
+// Read the stream header from the start of fd. Returns false if the
+// stream does not start with one.
+bool readStreamHeader(int fd, StreamParams &params) {
+  ChunkSize chunkSize;
+  if (!readAll(fd, (char*) &chunkSize, sizeof(chunkSize)) || !isSideChunk(chunkSize))
+    return false;
+  vector<char> chunk(sizeof(chunkSize) + chunkSize.compressed);
+  memcpy(chunk.data(), &chunkSize, sizeof(chunkSize));
+  if (!readAll(fd, chunk.data() + sizeof(chunkSize), chunkSize.compressed)) return false;
+  const char *cur = chunk.data();
+  return params.read(cur, chunk.data() + chunk.size());
+}
+
+// Read-only mapping of a whole file. data is nullptr if fd is not a
+// regular file (e.g. a pipe) or cannot be mapped.
+struct MappedFile {
+  const char *data;
+  size_t size;
+
+  MappedFile(int fd) : data(nullptr), size(0) {
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) return;
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) return;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    data = (const char*) p;
+    size = st.st_size;
+  }
+
+  ~MappedFile() {
+    if (data) munmap((void*) data, size);
+  }
+};
+
+// Same as readBlock, but finds the block [begin, blockEnd) in memory
+// at cur instead of copying it.
+bool sliceBlock(const char *&cur, const char *end, const char *&begin, const char *&blockEnd) {
+  const char *data;
+  ChunkSize chunkSize = nextChunk(cur, end, data);
+  if (!chunkSize.raw) return false;
+  begin = data - sizeof(chunkSize);
+  do {
+    chunkSize = nextChunk(cur, end, data);
+  } while (chunkSize.raw);
+  blockEnd = cur;
+  return true;
+}
+
+// read a frame of raw binary values of type In
+template<typename In, typename Real>
+bool readBinary(Real* targetBuffer, uint64_t numberOfTrajectories, int sourceFileHandle) {
+  if (is_same<In, Real>::value)
+    return readAll(sourceFileHandle, (char*) targetBuffer, sizeof(In) * numberOfTrajectories);
+  static vector<In> buf;
+  buf.resize(numberOfTrajectories);
+  if (!readAll(sourceFileHandle, (char*) buf.data(), sizeof(In) * numberOfTrajectories))
+    return false;
+  for (uint64_t i=0; i<numberOfTrajectories; i++)
+    targetBuffer[i] = buf[i];
+  return true;
+}
+
 /* read binary format data file, which contains <numberOfTrajectories> trajectories followed by <numberOfTrajectories> velocities and ??? */
+template<typename In, typename Real>
 bool readHubin(Real* targetBuffer, uint64_t numberOfTrajectories, int sourceFileHandle) {
-  uint32_t size = numberOfTrajectories * sizeof(Real);
-  static Real *trash = new Real[2*size];
+  // read payload (coordinates), skip the rest
+  return (readBinary<In, Real>(targetBuffer, numberOfTrajectories, sourceFileHandle)
+          && skipAll(sourceFileHandle, 2 * sizeof(In) * numberOfTrajectories));
+}
+
+// A frame source returns the next input frame (nullptr at the end),
+// either read into the passed buffer or pointing into a mapped file.
+template<typename Real>
+using FrameSource = function<const Real*(Real*)>;
 
-  // read payload (coordinates)
-  return (readAll(sourceFileHandle, (char*) targetBuffer, size)
-          && read(sourceFileHandle, trash, 2*size));
+// Frames of a mapped binary file, each numberOfTrajectories values of
+// type In followed by pad values to skip. The returned function hands
+// out the next frame (nullptr at the end): a pointer into the mapping
+// if In is Real, else the values converted into the passed buffer.
+template<typename In, typename Real>
+FrameSource<Real> mappedFrames(const MappedFile &file, uint64_t numberOfTrajectories, uint64_t pad = 0) {
+  const char *cur = file.data, *end = file.data + file.size;
+  return [=](Real *buf) mutable -> const Real* {
+    if (cur + sizeof(In) * numberOfTrajectories > end) return nullptr;
+    const In *frame = (const In*) cur;
+    cur += sizeof(In) * (numberOfTrajectories + pad);
+    if (is_same<In, Real>::value) return (const Real*) frame;
+    for (uint64_t i=0; i<numberOfTrajectories; i++)
+      buf[i] = frame[i];
+    return buf;
+  };
 }
 
+// Runs a frame source on a separate thread, which reads ahead into a
+// ring of numBatches batches of frames. Reading (and parsing) thus
+// overlaps with the consumer. Unlike with other frame sources, a frame
+// handed out stays valid only until the next call.
 template<typename Real>
-bool readTSV(Real* targetBuffer, uint64_t numberOfTrjectories, int sourceFileHandle) {
-  const int bufSz = 65536;
-  static char *buf = (char*) malloc(bufSz);
-  static int bufPos = 0, bufMax = 0;
-
-  char numBuf[32], c;
-  int numPos(0);
-  int ret;
-  uint64_t traj(0);
-  for (;;) {
-    // refill buffers if empty
-    if (bufPos == bufMax) {
-      ret = read(sourceFileHandle, buf, bufSz);
-      if (ret == 0) return false; // end of stream
-      if (ret < 0) {
-	    perror("while reading from input stream: ");
-	    exit(EXIT_FAILURE);
+struct ReadAhead {
+  struct Batch {
+    vector<Real> storage;
+    vector<const Real*> frame; // into storage or the source's memory
+  };
+
+  FrameSource<Real> source;
+  TId numTraj;
+  size_t framesPerBatch;
+  BoundedQueue<Batch> full, free;
+  Batch cur;
+  size_t next;
+  thread reader;
+
+  ReadAhead(FrameSource<Real> source, TId numTraj, size_t framesPerBatch, int numBatches)
+    : source(source), numTraj(numTraj), framesPerBatch(framesPerBatch),
+      full(numBatches), free(numBatches), next(0)
+  {
+    for (int i=0; i<numBatches; i++) {
+      Batch batch;
+      batch.storage.resize(framesPerBatch * numTraj);
+      free.push(move(batch));
+    }
+    reader = thread([this]() { read(); });
+  }
+
+  void read() {
+    Batch batch;
+    while (free.pop(batch)) {
+      batch.frame.clear();
+      while (batch.frame.size() < framesPerBatch) {
+	const Real *frame = source(batch.storage.data() + batch.frame.size() * numTraj);
+	if (!frame) break;
+	batch.frame.push_back(frame);
+      }
+      bool end = batch.frame.size() < framesPerBatch;
+      if (batch.frame.size() && !full.push(move(batch))) break;
+      if (end) break;
+    }
+    full.close();
+  }
+
+  const Real *operator()(Real*) {
+    if (next == cur.frame.size()) {
+      // the previous batch is done with
+      if (cur.storage.size()) free.push(move(cur));
+      cur.frame.clear();
+      next = 0;
+      if (!full.pop(cur)) return nullptr;
+    }
+    return cur.frame[next++];
+  }
+
+  ~ReadAhead() {
+    free.close();
+    full.close();
+    reader.join();
+  }
+};
+
+// Parses TSV frames, one line of numberOfTrajectories tab-separated
+// values each, from a stream or from memory (e.g. a mapped file).
+// All state is kept in the object, so several readers may be used at
+// once. Lines are located with memchr and the values converted with
+// from_chars, which stops at the tab behind each of them.
+//
+// readFrames() parses a batch of lines; if given a pool, the lines are
+// split among its threads.
+struct TSVReader {
+  int fd;                  // -1 when parsing from memory
+  uint64_t numTraj;
+  vector<char> buf;        // stream data
+  const char *cur, *end;   // unparsed data
+  vector<const char*> line; // starts of the lines of a batch, plus end
+
+  TSVReader(int fd, uint64_t numberOfTrajectories, size_t bufSize = 1 << 20)
+    : fd(fd), numTraj(numberOfTrajectories), buf(bufSize),
+      cur(buf.data()), end(buf.data()) {}
+
+  TSVReader(const char *data, size_t size, uint64_t numberOfTrajectories)
+    : fd(-1), numTraj(numberOfTrajectories), cur(data), end(data + size) {}
+
+  // Move the unparsed data to the front of buf and append more from
+  // the stream, growing buf if full. Returns false at the end of it.
+  bool refill() {
+    if (fd < 0) return false;
+    size_t left = end - cur;
+    memmove(buf.data(), cur, left);
+    if (left == buf.size()) buf.resize(2 * buf.size());
+    auto ret = read(fd, buf.data() + left, buf.size() - left);
+    if (ret < 0) {
+      perror("while reading from input stream: ");
+      exit(EXIT_FAILURE);
+    }
+    cur = buf.data();
+    end = cur + left + ret;
+    return ret > 0;
+  }
+
+  // Parse the line [begin, lineEnd) into dst.
+  template<typename Real>
+  void parseLine(const char *begin, const char *lineEnd, Real *dst) const {
+    const char *p = begin;
+    for (uint64_t i=0; i<numTraj; i++) {
+      Real val;
+      auto res = from_chars(p, lineEnd, val);
+      if ((res.ec != errc()) || (res.ptr != lineEnd && *res.ptr != '\t')) {
+	cerr << "malformed TSV value in line '" << string(begin, lineEnd) << "'\n";
+	exit(EXIT_FAILURE);
+      }
+      dst[i] = val;
+      p = res.ptr + 1;
+      if ((res.ptr == lineEnd) != (i + 1 == numTraj)) {
+	cerr << "expected " << numTraj << " values in line '" << string(begin, lineEnd) << "'\n";
+	exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // Parse up to maxFrames lines into dst (numTraj values per frame).
+  // Returns the number of frames read, 0 at the end of the input.
+  template<typename Real>
+  size_t readFrames(Real *dst, size_t maxFrames, ForkJoin *pool = nullptr) {
+    // find the lines of the batch, reading more if none is complete
+    line.clear();
+    const char *p = cur;
+    while (line.size() < maxFrames) {
+      const char *nl = (const char*) memchr(p, '\n', end - p);
+      if (!nl) {
+	if (line.size()) break;
+	size_t offset = p - cur;
+	bool more = refill();
+	p = cur + offset;
+	if (more) continue;
+	if (p == end) break;
+	nl = end; // last line without line break
+      }
+      line.push_back(p);
+      p = nl + 1;
+      if (nl == end) break;
+    }
+    if (line.empty()) return 0;
+    line.push_back(p);
+    cur = min(p, end);
+
+    size_t count = line.size() - 1;
+    auto parse = [&](size_t first, size_t step) {
+      for (size_t l=first; l<count; l+=step)
+	parseLine(line[l], line[l+1] - 1, dst + l * numTraj);
+    };
+    if (pool && (count > 1)) {
+      pool->run([&](int t) { parse(t, pool->size); });
+    }else{
+      parse(0, 1);
+    }
+    return count;
+  }
+
+  template<typename Real>
+  bool readFrame(Real *dst) {
+    return readFrames(dst, 1);
+  }
+};
+
+// Hands filled buffers to a thread that writes them to fd, so that
+// writing overlaps with filling the next buffer. At most numBuffers
+// buffers are in use, including the one being filled.
+struct WriteBehind {
+  int fd;
+  BoundedQueue<vector<char>> full, empty;
+  thread writer;
+
+  WriteBehind(int fd, int numBuffers) : fd(fd), full(numBuffers), empty(numBuffers) {
+    for (int i=1; i<numBuffers; i++)
+      empty.push(vector<char>());
+    writer = thread([this]() {
+      vector<char> buf;
+      while (full.pop(buf)) {
+	assert(writeAll(this->fd, buf.data(), buf.size()));
+	buf.clear();
+	empty.push(move(buf));
       }
-      bufPos = 0;
-      bufMax = ret;
+    });
+  }
+
+  // write buf eventually; returns an empty buffer in exchange
+  vector<char> put(vector<char> &&buf) {
+    full.push(move(buf));
+    vector<char> res;
+    empty.pop(res);
+    return res;
+  }
+
+  ~WriteBehind() {
+    full.close();
+    writer.join();
+  }
+};
+
+// Collects output in a large buffer that is handed to fd in one
+// write() per buffer size. With numBuffers > 1 the writes are done by
+// a WriteBehind thread.
+struct OutputBuffer {
+  int fd;
+  vector<char> buf;
+  size_t size, used;
+  unique_ptr<WriteBehind> behind;
+
+  OutputBuffer(int fd, size_t size = 1 << 20, int numBuffers = 0)
+    : fd(fd), buf(size), size(size), used(0),
+      behind(numBuffers > 1 ? new WriteBehind(fd, numBuffers) : nullptr) {}
+
+  // returns room for n bytes; pass the end of what was filled to commit()
+  char *reserve(size_t n) {
+    if (used + n > buf.size()) {
+      flush();
+      if (n > buf.size()) buf.resize(n);
+    }
+    return buf.data() + used;
+  }
+
+  void commit(char *end) {
+    used = end - buf.data();
+  }
+
+  void flush() {
+    if (!used) return;
+    if (behind) {
+      buf.resize(used);
+      buf = behind->put(move(buf));
+      buf.resize(size);
+    }else{
+      assert(writeAll(fd, buf.data(), used));
     }
-    // read one char, interpret it
-    c = *(buf + bufPos++);
-    switch (c) {
-    case '\n':
-    case '\t': // completed reading number
-      numBuf[numPos] = 0;
-      char *endp;
-      targetBuffer[traj] = strtod((char*) numBuf, &endp); // convert number digits to atcual number
-      assert(*endp == 0);
-      numPos = 0;
-      if (++traj == numberOfTrjectories) return c == '\n'; // after reading <numberOfTrjectories> values, we should find a line break. otherwise something is weird.
-      break;
-    default: // append digit to number
-      numBuf[numPos] = c;
-      assert(++numPos < 32);
+    used = 0;
+  }
+
+  ~OutputBuffer() {
+    flush();
+  }
+};
+
+// output stream that keeps track of its position
+struct StreamWriter {
+  OutputBuffer out;
+  uint64_t offset;
+
+  StreamWriter(int fd, int numBuffers = 0) : out(fd, 1 << 20, numBuffers), offset(0) {}
+
+  void write(const char *buf, size_t size) {
+    offset += size;
+    while (size) {
+      size_t n = min(size, out.size);
+      char *dst = out.reserve(n);
+      memcpy(dst, buf, n);
+      out.commit(dst + n);
+      buf += n;
+      size -= n;
     }
   }
-  return false;
+};
+
+// Write a frame as one line of tab separated values. Each value is
+// converted to Out and formatted as the shortest string that reads
+// back as the same Out.
+template<typename Out, typename Real>
+void writeTSV(OutputBuffer &out, const Real *values, uint64_t numberOfTrajectories) {
+  const size_t maxLen = 32; // "-1.2345678901234567e-308" and some
+  char *begin = out.reserve(numberOfTrajectories * maxLen + 1), *cur = begin;
+  for (uint64_t i=0; i<numberOfTrajectories; i++) {
+    cur = to_chars(cur, cur + maxLen, Out(values[i])).ptr;
+    *cur++ = '\t';
+  }
+  if (cur != begin) cur--;
+  *cur++ = '\n';
+  out.commit(cur);
+}
+
+// Write a frame as raw binary values of type Out, followed by pad
+// zeros (e.g. for the velocities of the hu* formats).
+template<typename Out, typename Real>
+void writeBinary(OutputBuffer &out, const Real *values, uint64_t numberOfTrajectories, uint64_t pad = 0) {
+  Out *cur = (Out*) out.reserve(sizeof(Out) * (numberOfTrajectories + pad));
+  for (uint64_t i=0; i<numberOfTrajectories; i++)
+    cur[i] = values[i];
+  memset(cur + numberOfTrajectories, 0, sizeof(Out) * pad);
+  out.commit((char*) (cur + numberOfTrajectories + pad));
 }
 
 template<typename Real>
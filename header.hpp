@@ -0,0 +1,118 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <assert.h>
+#include <string.h>
+#include <vector>
+
+#include "common.hpp"
+
+// Stream header, a side chunk in front of the first block:
+//
+//   StreamHeader, double[numTraj] (with streamErrorClasses),
+//   uint32_t n, uint32_t[n] (with streamSeparate)
+//
+// It records the options that change how the stream has to be
+// decoded, which the decoder then takes from the stream instead of
+// its own options. Chunk sources skip it like any side chunk.
+struct StreamHeader {
+  uint64_t magic;
+  uint32_t numTraj;
+  uint32_t flags;
+  uint32_t blockSize;
+};
+
+const uint64_t streamHeaderMagic = 0x3152444843545248; // "HRTCHDR1"
+
+// StreamHeader::flags
+const uint32_t streamQuadratic    = 1; // --quadratic
+const uint32_t streamErrorClasses = 2; // --error-class, the error scale of every trajectory follows
+const uint32_t streamJoint        = 4; // --joint
+const uint32_t streamSeparate     = 8; // --stream-codecs, the n candidate codec ids follow
+
+struct StreamParams {
+  TId numTraj;
+  bool joint, quadratic;
+  vector<double> errorScale; // empty if there are no error classes
+  vector<int> streamCodecs; // candidates of SelectCodec, empty if dt and v are coded together
+  uint32_t blockSize;
+
+  void write(function<void(const char*, size_t)> out) const {
+    StreamHeader header;
+    memset(&header, 0, sizeof(header)); // the padding, too
+    header.magic = streamHeaderMagic;
+    header.numTraj = numTraj;
+    header.flags = (quadratic ? streamQuadratic : 0) | (errorScale.size() ? streamErrorClasses : 0)
+      | (joint ? streamJoint : 0) | (streamCodecs.size() ? streamSeparate : 0);
+    header.blockSize = blockSize;
+    assert(errorScale.empty() || (errorScale.size() == numTraj));
+    vector<uint32_t> codecs;
+    if (streamCodecs.size()) {
+      codecs.push_back(streamCodecs.size());
+      codecs.insert(codecs.end(), streamCodecs.begin(), streamCodecs.end());
+    }
+    ChunkSize chunkSize;
+    chunkSize.raw = 0;
+    chunkSize.compressed = sizeof(header) + sizeof(double) * errorScale.size() + sizeof(uint32_t) * codecs.size();
+    out((char*) &chunkSize, sizeof(chunkSize));
+    out((char*) &header, sizeof(header));
+    out((char*) errorScale.data(), sizeof(double) * errorScale.size());
+    out((char*) codecs.data(), sizeof(uint32_t) * codecs.size());
+  }
+
+  // Read the header chunk at cur (which has to be complete) and
+  // advance cur behind it. Returns false if there is none.
+  bool read(const char *&cur, const char *end) {
+    ChunkSize chunkSize;
+    StreamHeader header;
+    if (cur + sizeof(chunkSize) > end) return false;
+    memcpy(&chunkSize, cur, sizeof(chunkSize));
+    if (!isSideChunk(chunkSize) || (chunkSize.compressed < sizeof(header))
+	|| (cur + sizeof(chunkSize) + chunkSize.compressed > end))
+      return false;
+    memcpy(&header, cur + sizeof(chunkSize), sizeof(header));
+    if (header.magic != streamHeaderMagic) return false;
+    numTraj = header.numTraj;
+    joint = header.flags & streamJoint;
+    quadratic = header.flags & streamQuadratic;
+    blockSize = header.blockSize;
+    const char *data = cur + sizeof(chunkSize) + sizeof(header), *dataEnd = cur + sizeof(chunkSize) + chunkSize.compressed;
+    errorScale.clear();
+    if (header.flags & streamErrorClasses) {
+      if (data + sizeof(double) * numTraj > dataEnd) return false;
+      errorScale.resize(numTraj);
+      memcpy(errorScale.data(), data, sizeof(double) * numTraj);
+      data += sizeof(double) * numTraj;
+    }
+    streamCodecs.clear();
+    if (header.flags & streamSeparate) {
+      uint32_t n;
+      if (data + sizeof(n) > dataEnd) return false;
+      memcpy(&n, data, sizeof(n));
+      data += sizeof(n);
+      if (!n || (n > uint64_t(dataEnd - data) / sizeof(uint32_t))) return false;
+      vector<uint32_t> codecs(n);
+      memcpy(codecs.data(), data, sizeof(uint32_t) * n);
+      streamCodecs.assign(codecs.begin(), codecs.end());
+    }
+    cur = dataEnd;
+    return true;
+  }
+};
@@ -16,61 +16,682 @@
    along with this program (see file LICENSE).  If not, see
    <http://www.gnu.org/licenses/>. */
 
+#include <fcntl.h>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "checkpoint.hpp"
 #include "common.hpp"
 #include "compressor.hpp"
 #include "decompressor.hpp"
 #include "format.hpp"
+#include "index.hpp"
+#include "parallel.hpp"
+#include "pbc.hpp"
+#include "shard.hpp"
 
 const int chunkSize = 1024;
 
-template<typename Real>
-void compressionLoop(function<CompressorState<Real>*(void)> compressorFactory,
-	      function<bool(Real*, TId, int)> reader,
-	      TId numberOfTrajectories, int sourceFileHandle, int blockSize) {
+// The compressors write to out; the start of each block is recorded
+// in index.
+template<typename Real, typename Compressor>
+void compressionLoop(function<Compressor*(void)> compressorFactory,
+	      FrameSource<Real> nextFrame,
+	      TId numberOfTrajectories, int blockSize,
+	      StreamWriter &out, BlockIndex &index) {
   Real *trajectoryData = new Real[numberOfTrajectories];
   int block(blockSize);
-  CompressorState<Real> *compressor(nullptr);
-  while (reader(trajectoryData, numberOfTrajectories, sourceFileHandle)) {
+  Compressor *compressor(nullptr);
+  while (const Real *frame = nextFrame(trajectoryData)) {
     if (block == blockSize) {
       if (compressor) {
 	      compressor->finish();
 	      delete compressor;
       }
+      index.addBlock(out.offset, index.numFrames);
       compressor = compressorFactory();
       block = 0;
     }
-    compressor->addFrame(trajectoryData);
+    compressor->addFrame(frame);
+    index.numFrames++;
     block++;
   }
-  if (block)
+  if (compressor) {
     compressor->finish();
-  if (compressor)
     delete compressor;
+  }
+  delete[] trajectoryData;
   cerr << "done at " << __LINE__ << endl;
 }
 
-double *foo = new double;
-
+// Same as compressionLoop, but blocks are compressed concurrently by
+// numThreads workers. The calling thread reads whole blocks into a
+// pool of frame buffers (or just takes pointers to mapped frames),
+// each worker compresses a block into a
+// private buffer and a writer thread emits those in block order. The
+// output is identical to that of compressionLoop.
+//
+// If given, checkpoints computes the payload of a side chunk for each
+// compressed block, which is written right after it.
 template<typename Real>
-void decompressionLoop(function<DecompressorState<Real>*(void)> decompressorFactory,
-		TId numberOfTrajectories, uint blockSize) {
+void parallelCompressionLoop(function<CompressorState<Real>*(ChunkSink)> compressorFactory,
+	      FrameSource<Real> nextFrame,
+	      TId numberOfTrajectories, int blockSize,
+	      int numThreads, StreamWriter &out, BlockIndex &index,
+	      function<vector<char>(const vector<char>&)> checkpoints = nullptr) {
+  struct Block {
+    uint64_t seq;
+    Real *frames;
+    vector<const Real*> frame; // into frames or the mapped input
+  };
+  // two buffers per worker keep all of them busy while reading
+  const int numBuffers = 2 * numThreads;
+  BoundedQueue<Real*> freeBuffers(numBuffers);
+  for (int i=0; i<numBuffers; i++)
+    freeBuffers.push(new Real[size_t(numberOfTrajectories) * blockSize]);
+  BoundedQueue<Block> todo(numBuffers);
+  ReorderQueue<pair<vector<char>, vector<char>>> done(numBuffers); // block, side chunk
+
+  vector<thread> workers;
+  for (int i=0; i<numThreads; i++) {
+    workers.emplace_back([&]() {
+      Block block;
+      while (todo.pop(block)) {
+	vector<char> out;
+	CompressorState<Real> *compressor = compressorFactory(appendChunks(out));
+	for (const Real *frame : block.frame)
+	  compressor->addFrame(frame);
+	compressor->finish();
+	delete compressor;
+	freeBuffers.push(block.frames);
+	vector<char> side;
+	if (checkpoints) side = checkpoints(out);
+	done.push(block.seq, make_pair(move(out), move(side)));
+      }
+    });
+  }
+
+  thread writer([&]() {
+    pair<vector<char>, vector<char>> buf;
+    for (uint64_t seq=0; done.pop(buf); seq++) {
+      uint64_t offset = out.offset;
+      out.write(buf.first.data(), buf.first.size());
+      uint64_t checkpointOffset = 0;
+      if (buf.second.size()) {
+	checkpointOffset = out.offset;
+	ChunkSize chunkSize;
+	chunkSize.raw = 0;
+	chunkSize.compressed = buf.second.size();
+	out.write((char*) &chunkSize, sizeof(chunkSize));
+	out.write(buf.second.data(), buf.second.size());
+      }
+      index.addBlock(offset, seq * blockSize, checkpointOffset);
+    }
+  });
+
+  for (uint64_t seq=0;; seq++) {
+    Block block;
+    block.seq = seq;
+    freeBuffers.pop(block.frames);
+    while (block.frame.size() < size_t(blockSize)) {
+      const Real *frame = nextFrame(block.frames + block.frame.size() * numberOfTrajectories);
+      if (!frame) break;
+      block.frame.push_back(frame);
+    }
+    if (block.frame.empty()) {
+      freeBuffers.push(block.frames);
+      break;
+    }
+    index.numFrames += block.frame.size();
+    bool last = block.frame.size() < size_t(blockSize);
+    todo.push(move(block));
+    if (last) break;
+  }
+  todo.close();
+  for (auto &worker : workers)
+    worker.join();
+  done.close();
+  writer.join();
+
+  freeBuffers.close();
+  Real *buf;
+  while (freeBuffers.pop(buf))
+    delete[] buf;
+}
+
+// The factory may return nullptr to signal the end of the stream.
+// The first skip frames are decoded but not output, and at most count
+// frames are passed to output. If given, restore may fast forward the
+// first decompressor to a frame <= skip and returns that frame.
+template<typename Real, typename Decompressor>
+void decompressionLoop(function<Decompressor*(void)> decompressorFactory,
+		function<void(const Real*)> output,
+		TId numberOfTrajectories, uint blockSize,
+		uint64_t skip = 0, uint64_t count = -1,
+		function<Time(Decompressor*, Time)> restore = nullptr) {
   Real *trajectoryData = new Real[numberOfTrajectories];
   uint frameInBlock;
   do {
     frameInBlock = 0;
-    DecompressorState<Real> *decompressor = decompressorFactory();
-    while (decompressor->readFrame(trajectoryData)) {
+    Decompressor *decompressor = decompressorFactory();
+    if (!decompressor) break;
+    if (skip && restore) {
+      Time t = restore(decompressor, skip);
+      frameInBlock += t;
+      skip -= t;
+      restore = nullptr;
+    }
+    for (; skip && decompressor->readFrame(nullptr); skip--)
       frameInBlock++;
-      for (int i=0; i<numberOfTrajectories; i++) {
-	      *foo = trajectoryData[i];
-	      //cout << (i ? "\t" : "") << trajectoryData[i];
-      }
-      //cout << endl;
+    while (count && decompressor->readFrame(trajectoryData)) {
+      frameInBlock++;
+      count--;
+      output(trajectoryData);
     }
     delete decompressor;
-  } while (frameInBlock == blockSize);
+  } while (count && (frameInBlock == blockSize));
 }
 
+// A compressed block, either held in storage or pointing into a
+// mapped stream.
+struct CompressedBlock {
+  vector<char> storage;
+  const char *begin, *end;
+};
+
+// Same as decompressionLoop for unsharded streams, but numThreads
+// blocks are decoded concurrently. A reader thread fetches the blocks
+// via nextBlock (false at the end) and deals them out round robin. Each worker decodes its
+// blocks into a few pieces of framesPerPiece frames, which the calling
+// thread takes from the workers in block order and outputs. Memory
+// use thus does not grow with the block size.
+template<typename Real>
+void parallelDecompressionLoop(function<DecompressorState<Real>*(ChunkSource)> decompressorFactory,
+		function<void(const Real*)> output,
+		function<bool(CompressedBlock&)> nextBlock,
+		TId numberOfTrajectories, uint blockSize,
+		int numThreads, uint64_t skip, uint64_t count) {
+  const uint framesPerPiece = 16;
+  const int piecesPerWorker = 3;
+  struct Piece {
+    Real *frames;
+    uint count; // of frames
+    bool last;  // of its block
+  };
+  struct Worker {
+    BoundedQueue<CompressedBlock> todo;
+    BoundedQueue<Piece> full;
+    BoundedQueue<Real*> free;
+    Worker() : todo(2), full(piecesPerWorker), free(piecesPerWorker) {}
+  };
+  vector<Real> pieceData(size_t(numThreads) * piecesPerWorker * framesPerPiece * numberOfTrajectories);
+  vector<unique_ptr<Worker>> workers;
+  for (int w=0; w<numThreads; w++) {
+    workers.emplace_back(new Worker());
+    for (int p=0; p<piecesPerWorker; p++)
+      workers[w]->free.push(pieceData.data() + (size_t(w) * piecesPerWorker + p) * framesPerPiece * numberOfTrajectories);
+  }
+
+  thread reader([&]() {
+    CompressedBlock block;
+    for (uint64_t seq=0; nextBlock(block); seq++)
+      if (!workers[seq % numThreads]->todo.push(move(block))) break;
+    for (auto &w : workers)
+      w->todo.close();
+  });
+
+  vector<thread> threads;
+  for (int w=0; w<numThreads; w++) {
+    threads.emplace_back([&, w]() {
+      Worker &me = *workers[w];
+      CompressedBlock block;
+      bool ok = true;
+      for (uint64_t seq=w; ok && me.todo.pop(block); seq+=numThreads) {
+	DecompressorState<Real> *decompressor = decompressorFactory(readChunks(block.begin, block.end));
+	if (!seq) decompressor->skipFrames(skip);
+	Piece piece;
+	piece.last = false;
+	while (ok && !piece.last) {
+	  if (!(ok = me.free.pop(piece.frames))) break;
+	  for (piece.count=0; piece.count<framesPerPiece; piece.count++) {
+	    if (!decompressor->readFrame(piece.frames + size_t(piece.count) * numberOfTrajectories)) {
+	      piece.last = true;
+	      break;
+	    }
+	  }
+	  ok = me.full.push(piece);
+	}
+	delete decompressor;
+      }
+      me.full.close();
+    });
+  }
+
+  for (uint64_t seq=0; count; seq++) {
+    Worker &w = *workers[seq % numThreads];
+    uint64_t frameInBlock = seq ? 0 : skip;
+    Piece piece;
+    piece.last = false;
+    while (count && !piece.last) {
+      if (!w.full.pop(piece)) {
+	count = 0; // end of stream
+	break;
+      }
+      for (uint f=0; (f<piece.count) && count; f++, count--)
+	output(piece.frames + size_t(f) * numberOfTrajectories);
+      frameInBlock += piece.count;
+      w.free.push(piece.frames);
+    }
+    if (frameInBlock < blockSize) break;
+  }
+
+  // stop the reader and workers, which may be ahead
+  for (auto &w : workers) {
+    w->todo.close();
+    w->full.close();
+    w->free.close();
+  }
+  reader.join();
+  for (auto &t : threads)
+    t.join();
+}
+
+// Parse a list of trajectory ids like "3,10-19,42" (ranges are
+// inclusive) into a sorted list without duplicates.
+vector<TId> parseSelection(string str, TId numTraj) {
+  vector<TId> res;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ',')) {
+    unsigned long first, last;
+    char dash;
+    stringstream range(item);
+    bool ok = bool(range >> first);
+    last = first;
+    if (ok && (range >> dash))
+      ok = (dash == '-') && (range >> last) && (range >> ws).eof();
+    if (!ok || (first > last) || (last >= numTraj)) {
+      cerr << "invalid trajectory selection '" << item << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    for (unsigned long id=first; id<=last; id++)
+      res.push_back(id);
+  }
+  sort(res.begin(), res.end());
+  res.erase(unique(res.begin(), res.end()), res.end());
+  return res;
+}
+
+// box lengths like 3.2,3.2,4.5 (or one for all dimensions)
+vector<double> parseBox(string str) {
+  vector<double> res;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ',')) {
+    double len;
+    stringstream val(item);
+    if (!(val >> len) || !(val >> ws).eof() || !(len > 0)) {
+      cerr << "invalid box length '" << item << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    res.push_back(len);
+  }
+  if (res.empty()) {
+    cerr << "--pbc requires box lengths\n";
+    exit(EXIT_FAILURE);
+  }
+  return res;
+}
+
+// codec ids like 5,14,100
+vector<int> parseCodecs(string str) {
+  vector<int> res;
+  stringstream ss(str);
+  string item;
+  while (getline(ss, item, ',')) {
+    int id;
+    stringstream val(item);
+    if (!(val >> id) || !(val >> ws).eof() || !codecExists(id)) {
+      cerr << "invalid codec id '" << item << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    res.push_back(id);
+  }
+  if (res.empty()) {
+    cerr << "--stream-codecs requires codec ids\n";
+    exit(EXIT_FAILURE);
+  }
+  return res;
+}
+
+// Error classes like 3000-8999:0.2 (a trajectory selection and its
+// error bound, later ones taking precedence) as factors on --error of
+// every trajectory; empty if there are none.
+vector<double> parseErrorClasses(const vector<string> &classes, TId numTraj, double error) {
+  vector<double> res;
+  for (auto &c : classes) {
+    size_t colon = c.rfind(':');
+    double classError;
+    stringstream val(colon == string::npos ? string() : c.substr(colon + 1));
+    if (!(val >> classError) || !(val >> ws).eof() || !(classError > 0)) {
+      cerr << "invalid error class '" << c << "'\n";
+      exit(EXIT_FAILURE);
+    }
+    if (res.empty())
+      res.assign(numTraj, 1);
+    for (TId i : parseSelection(c.substr(0, colon), numTraj))
+      res[i] = classError / error;
+  }
+  return res;
+}
+
+// Settings from the command line; compress() and decompress() run
+// with Real = float or double, depending on --format.
+struct Settings {
+  TId numberOfTrajectories;
+  int sourceFileHandle, sinkFileHandle;
+  double error, quantum, bound;
+  int integerEncoder;
+  int numThreads, numShards, shardThreads;
+  bool sharded;
+  uint checkpointInterval;
+  int ioBuffers;
+  int dim; // trajectories compressed jointly
+  bool quadratic; // segment predictor
+  vector<double> box; // periodic box lengths, empty if none
+  vector<double> errorScale; // factor on error and quantum of each trajectory, empty if none
+  vector<int> streamCodecs; // candidates for dt and v of each chunk, empty to code them together
+
+  CodecPtr codec() const {
+    if (streamCodecs.empty()) return createCodec(integerEncoder);
+    return CodecPtr(new SelectCodec(streamCodecs));
+  }
+
+  // errorScale of the trajectories from first on
+  const double *scale(TId first) const {
+    return errorScale.empty() ? nullptr : errorScale.data() + first;
+  }
+
+  template<typename Real>
+  void decompress(prog_options::variables_map &options) {
+    // the stream overrides the options it records
+    StreamParams params;
+    if (!readStreamHeader(sourceFileHandle, params)) {
+      cerr << "the source is no compressed stream (its header is missing)\n";
+      exit(EXIT_FAILURE);
+    }
+    if (params.numTraj != numberOfTrajectories) {
+      cerr << "the stream holds " << params.numTraj << " trajectories, not --numtraj " << numberOfTrajectories << endl;
+      exit(EXIT_FAILURE);
+    }
+    dim = params.joint ? 3 : 1;
+    quadratic = params.quadratic;
+    uint blockSize = params.blockSize;
+    if (errorScale.size() && (errorScale != params.errorScale)) {
+      cerr << "--error-class does not match the error classes of the stream\n";
+      exit(EXIT_FAILURE);
+    }
+    errorScale = params.errorScale;
+    for (int id : params.streamCodecs)
+      if (!codecExists(id)) {
+	cerr << "the stream uses code " << id << ", which is not available\n";
+	exit(EXIT_FAILURE);
+      }
+    streamCodecs = params.streamCodecs;
+
+    // jump to the block containing the first requested frame
+    uint64_t skip = 0;
+    uint64_t count = options.count("count") ? options["count"].as<uint64_t>() : -1;
+    BlockIndexEntry seekBlock;
+    seekBlock.checkpoints = 0;
+    if (options.count("seek")) {
+      uint64_t seek = options["seek"].as<uint64_t>();
+      BlockIndex index;
+      if (!index.read(sourceFileHandle)) {
+	cerr << "--seek requires a seekable source with block index\n";
+	exit(EXIT_FAILURE);
+      }
+      if (seek < index.numFrames) {
+	seekBlock = index.blocks[index.find(seek)];
+	assert(lseek(sourceFileHandle, seekBlock.offset, SEEK_SET) == off_t(seekBlock.offset));
+	skip = seek - seekBlock.firstFrame;
+      }else{
+	count = 0;
+      }
+    }
+
+    // access the compressed stream in place if it can be mapped
+    MappedFile map(sourceFileHandle);
+    const char *mapCur = nullptr, *mapEnd = map.data + map.size;
+    if (map.data)
+      mapCur = map.data + lseek(sourceFileHandle, 0, SEEK_CUR);
+
+    auto makeDecompressor = [&](TId first, TId numTraj, ChunkSource chunkSrc) {
+      return new DecompressorState<Real> (numTraj, quantum, chunkSize, codec(), chunkSrc, dim, quadratic, scale(first));
+    };
+    vector<TId> select;
+    if (options.count("select"))
+      select = parseSelection(options["select"].as<string>(), numberOfTrajectories);
+
+    OutputBuffer outBuf(sinkFileHandle, 1 << 20, ioBuffers);
+    function<void(const Real*, TId)> writer;
+    auto fmtString = options["format"].as<string>();
+    if      (fmtString == "tsvfloat")  { writer = [&](const Real *v, TId n) { writeTSV<float>(outBuf, v, n); }; }
+    else if (fmtString == "tsvdouble") { writer = [&](const Real *v, TId n) { writeTSV<double>(outBuf, v, n); }; }
+    else if (fmtString == "binfloat")  { writer = [&](const Real *v, TId n) { writeBinary<float>(outBuf, v, n); }; }
+    else if (fmtString == "bindouble") { writer = [&](const Real *v, TId n) { writeBinary<double>(outBuf, v, n); }; }
+    else if (fmtString == "hufloat")   { writer = [&](const Real *v, TId n) { writeBinary<float>(outBuf, v, n, 2*n); }; }
+    else if (fmtString == "hudouble")  { writer = [&](const Real *v, TId n) { writeBinary<double>(outBuf, v, n, 2*n); }; }
+    else                               { cerr << "unknown format " << fmtString << endl; exit(EXIT_FAILURE); }
+    function<void(const Real*)> output;
+    vector<Real> selected(select.size());
+    if (select.empty()) {
+      output = [&](const Real *frame) { writer(frame, numberOfTrajectories); };
+    }else{
+      output = [&](const Real *frame) {
+	for (size_t i=0; i<select.size(); i++)
+	  selected[i] = frame[select[i]];
+	writer(selected.data(), selected.size());
+      };
+    }
+    // undo the unwrapping of the compressor
+    vector<Real> period, wrapped;
+    if (box.size()) {
+      period = trajectoryPeriods<Real>(box, numberOfTrajectories);
+      wrapped.resize(numberOfTrajectories);
+      output = [&, output](const Real *frame) {
+	copy_n(frame, numberOfTrajectories, wrapped.data());
+	wrapFrame(period.data(), wrapped.data(), numberOfTrajectories);
+	output(wrapped.data());
+      };
+    }
+    if (sharded) {
+      // load only the shards holding selected trajectories
+      function<bool(TId, TId)> wanted;
+      if (select.size()) {
+	wanted = [&](TId first, TId num) {
+	  auto it = lower_bound(select.begin(), select.end(), first);
+	  return (it != select.end()) && (*it < first + num);
+	};
+      }
+      ForkJoin pool(shardThreads);
+      function<ShardedDecompressor<Real>*(void)> decompressorFactory = [&]() -> ShardedDecompressor<Real>* {
+	vector<char> block;
+	if (!readShardedBlock(sourceFileHandle, block, wanted)) return nullptr;
+	return new ShardedDecompressor<Real>(move(block), pool, makeDecompressor);
+      };
+      decompressionLoop<Real>(decompressorFactory, output, numberOfTrajectories, blockSize, skip, count);
+    }else if (numThreads > 1) {
+      function<DecompressorState<Real>*(ChunkSource)> decompressorFactory = [&](ChunkSource chunkSrc) {
+	return makeDecompressor(0, numberOfTrajectories, chunkSrc);
+      };
+      function<bool(CompressedBlock&)> nextBlock = [&](CompressedBlock &block) {
+	if (map.data)
+	  return sliceBlock(mapCur, mapEnd, block.begin, block.end);
+	if (!readBlock(sourceFileHandle, block.storage)) return false;
+	block.begin = block.storage.data();
+	block.end = block.begin + block.storage.size();
+	return true;
+      };
+      parallelDecompressionLoop<Real>(decompressorFactory, output, nextBlock, numberOfTrajectories, blockSize, numThreads, skip, count);
+    }else{
+      function<DecompressorState<Real>*(void)> decompressorFactory = [&]() {
+	return makeDecompressor(0, numberOfTrajectories, [&](char* buf, const char *&data) -> ChunkSize {
+	  if (map.data)
+	    return nextChunk(mapCur, mapEnd, data);
+	  ChunkSize chunkSize;
+	  while (readAll(sourceFileHandle, (char*) &chunkSize, sizeof(chunkSize))) {
+	    if (!isSideChunk(chunkSize)) {
+	      assert(readAll(sourceFileHandle, buf, chunkSize.compressed));
+	      data = buf;
+	      return chunkSize;
+	    }
+	    assert(skipAll(sourceFileHandle, chunkSize.compressed));
+	  }
+	  chunkSize.compressed = 0, chunkSize.raw = 0;
+	  return chunkSize;
+	});
+      };
+      function<Time(DecompressorState<Real>*, Time)> restore;
+      if (seekBlock.checkpoints) {
+	restore = [&](DecompressorState<Real> *decompressor, Time frame) {
+	  return restoreCheckpoint<Real>(sourceFileHandle, seekBlock.offset, seekBlock.checkpoints, *decompressor, frame, [&](uint64_t offset) {
+	    if (map.data)
+	      mapCur = map.data + offset;
+	    else
+	      assert(lseek(sourceFileHandle, offset, SEEK_SET) == off_t(offset));
+	  });
+	};
+      }
+      decompressionLoop<Real>(decompressorFactory, output, numberOfTrajectories, blockSize, skip, count, restore);
+    }
+  }
+
+  template<typename Real>
+  void compress(prog_options::variables_map &options) {
+    auto makeCompressor = [&](TId first, TId numTraj, ChunkSink sink) {
+      return new CompressorState<Real>
+      (numTraj, error, bound, quantum, chunkSize, codec(), sink, dim, quadratic, scale(first));
+    };
+    uint blockSize = options["blocksize"].as<uint>();
+    StreamWriter out(sinkFileHandle, ioBuffers);
+    StreamParams{numberOfTrajectories, dim > 1, quadratic, errorScale, streamCodecs, blockSize}.write([&](const char *buf, size_t size) { out.write(buf, size); });
+    BlockIndex index;
+    auto fileSink = [&](char* buf, ChunkSize chunkSize) {
+      out.write((char*) &chunkSize, sizeof(chunkSize));
+      out.write(buf, chunkSize.compressed);
+    };
+
+    function<bool(Real*, TId, int)> format;
+    auto fmtString = options["format"].as<string>();
+    bool tsv = (fmtString == "tsvfloat") || (fmtString == "tsvdouble");
+    if      (tsv)                      { }
+    else if (fmtString == "binfloat")  { format = readBinary<float, Real>; }
+    else if (fmtString == "bindouble") { format = readBinary<double, Real>; }
+    else if (fmtString == "hufloat")   { format = readHubin<float, Real>; }
+    else if (fmtString == "hudouble")  { format = readHubin<double, Real>; }
+    else                               { cerr << "unknown input format " << fmtString << endl; exit(EXIT_FAILURE); }
+
+    // binary input is taken from the mapped file where possible
+    MappedFile map(sourceFileHandle);
+    FrameSource<Real> nextFrame = [&](Real *buf) -> const Real* {
+      return format(buf, numberOfTrajectories, sourceFileHandle) ? buf : nullptr;
+    };
+    if (map.data) {
+      TId n = numberOfTrajectories;
+      if      (fmtString == "binfloat")  { nextFrame = mappedFrames<float,  Real>(map, n); }
+      else if (fmtString == "bindouble") { nextFrame = mappedFrames<double, Real>(map, n); }
+      else if (fmtString == "hufloat")   { nextFrame = mappedFrames<float,  Real>(map, n, 2*n); }
+      else if (fmtString == "hudouble")  { nextFrame = mappedFrames<double, Real>(map, n, 2*n); }
+    }
+
+    // TSV is parsed in batches of frames, by --threads threads
+    const size_t tsvBatch = 256;
+    unique_ptr<TSVReader> tsvReader;
+    unique_ptr<ForkJoin> parsePool;
+    vector<Real> tsvFrames;
+    size_t tsvCur = 0, tsvCount = 0;
+    if (tsv) {
+      if (map.data)
+	tsvReader.reset(new TSVReader(map.data, map.size, numberOfTrajectories));
+      else
+	tsvReader.reset(new TSVReader(sourceFileHandle, numberOfTrajectories));
+      if (numThreads > 1)
+	parsePool.reset(new ForkJoin(numThreads));
+      tsvFrames.resize(tsvBatch * numberOfTrajectories);
+      nextFrame = [&](Real *buf) -> const Real* {
+	if (tsvCur == tsvCount) {
+	  tsvCur = 0;
+	  tsvCount = tsvReader->readFrames(tsvFrames.data(), tsvBatch, parsePool.get());
+	  if (!tsvCount) return nullptr;
+	}
+	// the caller may keep the frame, so it is not left in tsvFrames
+	copy_n(tsvFrames.data() + tsvCur++ * numberOfTrajectories, numberOfTrajectories, buf);
+	return buf;
+      };
+    }
+
+    // unwrap periodic trajectories, anew in every block
+    unique_ptr<Unwrapper<Real>> unwrap;
+    uint64_t unwrapped = 0;
+    if (box.size()) {
+      unwrap.reset(new Unwrapper<Real>(trajectoryPeriods<Real>(box, numberOfTrajectories)));
+      nextFrame = [&, nextFrame](Real *buf) -> const Real* {
+	const Real *frame = nextFrame(buf);
+	if (!frame) return nullptr;
+	if (!(unwrapped++ % blockSize)) unwrap->reset();
+	(*unwrap)(frame, buf);
+	return buf;
+      };
+    }
+
+    // Read ahead on a separate thread for compressionLoop.
+    // parallelCompressionLoop keeps frames for longer and reads
+    // concurrently with its workers anyway.
+    shared_ptr<ReadAhead<Real>> readAhead;
+    FrameSource<Real> prefetched = nextFrame;
+    bool parallel = !sharded && ((numThreads > 1) || checkpointInterval);
+    if ((ioBuffers > 1) && !parallel) {
+      size_t framesPerBatch = max<size_t>(1, (1 << 20) / (sizeof(Real) * numberOfTrajectories));
+      readAhead.reset(new ReadAhead<Real>(nextFrame, numberOfTrajectories, framesPerBatch, ioBuffers));
+      prefetched = [=](Real *buf) { return (*readAhead)(buf); };
+    }
+
+    if (sharded) {
+      ForkJoin pool(shardThreads);
+      function<ShardedCompressor<Real>*(void)> compressorFactory = [&]() {
+	return new ShardedCompressor<Real>(numberOfTrajectories, numShards, pool, makeCompressor, [&](const char *buf, size_t size) {
+	  out.write(buf, size);
+	}, dim);
+      };
+      compressionLoop<Real>(compressorFactory, prefetched, numberOfTrajectories, blockSize, out, index);
+    }else if (parallel) {
+      // checkpoints are computed from the compressed block, which
+      // parallelCompressionLoop buffers anyway
+      function<CompressorState<Real>*(ChunkSink)> compressorFactory = [&](ChunkSink sink) {
+	return makeCompressor(0, numberOfTrajectories, sink);
+      };
+      function<vector<char>(const vector<char>&)> checkpoints;
+      if (checkpointInterval) {
+	checkpoints = [&](const vector<char> &block) {
+	  return buildCheckpoints<Real>(block, numberOfTrajectories, checkpointInterval, [&](ChunkSource src) {
+	    return new DecompressorState<Real> (numberOfTrajectories, quantum, chunkSize, codec(), src, dim, quadratic, scale(0));
+	  });
+	};
+      }
+      parallelCompressionLoop<Real>(compressorFactory, nextFrame, numberOfTrajectories, blockSize, numThreads, out, index, checkpoints);
+    }else{
+      function<CompressorState<Real>*(void)> compressorFactory = [&]() {
+	return makeCompressor(0, numberOfTrajectories, fileSink);
+      };
+      compressionLoop<Real>(compressorFactory, prefetched, numberOfTrajectories, blockSize, out, index);
+    }
+    index.write([&](const char *buf, size_t size) { out.write(buf, size); });
+  }
+};
+
 int main(int argc, char **argv) {
   /// parse cmd line options
   prog_options::options_description cmdOpts("Synopsis");
@@ -82,19 +703,43 @@ int main(int argc, char **argv) {
 	  ("dst", prog_options::value<std::string>()->default_value("-"),
 	   "destination file name")
 	  ("format", prog_options::value<std::string>()->default_value("tsvfloat"),
-	   "file format: hufloat, hudouble, tsvfloat, tsvdouble...")
+	   "file format: hufloat, hudouble, tsvfloat, tsvdouble, binfloat, bindouble")
 	  ("numtraj", prog_options::value<TId>(),
 	   "number of trajectories (#particles * #dim)")
 	  ("bound", prog_options::value<double>(),
 	   "maximal (absolute) value of a trajectory")
 	  ("error", prog_options::value<double>(),
 	   "maximal deviation from trajectory (quantization + prediction)")
+	  ("error-class", prog_options::value<vector<string>>()->composing(),
+	   "maximal deviation of some trajectories instead of --error, e.g. 3000-8999:0.2 (repeatable)")
 	  ("qp-ratio", prog_options::value<double>()->default_value(0.1),
 	   "ratio (0..1) to split the error between quantization and prediction")
 	  ("blocksize", prog_options::value<uint>()->default_value(1024),
 	   "frames per block")
 	  ("integer-encoding", prog_options::value<int>()->default_value(14),
-	   "code id used by integer encoding library")
+	   "code id used by integer encoding library, or 100 for rANS")
+	  ("stream-codecs", prog_options::value<string>(),
+	   "code dt and v of each chunk separately, each with the smallest of these codes, e.g. 5,14,100")
+	  ("threads", prog_options::value<int>()->default_value(1),
+	   "number of blocks (de)compressed concurrently")
+	  ("shards", prog_options::value<int>()->default_value(1),
+	   "split the trajectories of each block into this many independently (de)compressed shards")
+	  ("shard-size", prog_options::value<TId>(),
+	   "split the trajectories of each block into shards of this many trajectories, (de)compressed by --threads threads")
+	  ("select", prog_options::value<string>(),
+	   "decompress only these trajectories, e.g. 3,10-19")
+	  ("seek", prog_options::value<uint64_t>(),
+	   "decompress starting at this frame (requires a seekable source)")
+	  ("count", prog_options::value<uint64_t>(),
+	   "decompress at most this many frames")
+	  ("checkpoint-interval", prog_options::value<uint>()->default_value(0),
+	   "store decoder checkpoints every this many frames of a block for --seek (0: none)")
+	  ("io-buffers", prog_options::value<int>()->default_value(4),
+	   "buffers read ahead and written behind by separate I/O threads (0: synchronous I/O)")
+	  ("joint", "compress x, y and z of each particle (consecutive trajectories) with common segments")
+	  ("quadratic", "predict with quadratic instead of linear segments (for steadily curved trajectories)")
+	  ("pbc", prog_options::value<string>(),
+	   "periodic box lengths of the dimensions, e.g. 3.2,3.2,4.5: compress unwrapped, decompress wrapped into [0, length)")
 	  ;
   prog_options::variables_map options; // this stores command line options
   try {
@@ -137,36 +782,69 @@ int main(int argc, char **argv) {
   double quantum     = require("error").as<double>() * qpr * 2;
   double bound       = require("bound").as<double>();
   int integerEncoder = require("integer-encoding").as<int>();
+  if (!codecExists(integerEncoder)) {
+    cerr << "unknown --integer-encoding " << integerEncoder << "\n";
+    exit(EXIT_FAILURE);
+  }
   
+  int numThreads = require("threads").as<int>();
+  int numShards  = require("shards").as<int>();
+  assert((numThreads >= 1) && (numShards >= 1));
+  if ((numThreads > 1) && (numShards > 1)) {
+    cerr << "--threads and --shards are mutually exclusive\n";
+    exit(EXIT_FAILURE);
+  }
+  // --shards uses one thread per shard, --shard-size the --threads
+  // threads for all shards of a block
+  bool sharded = numShards > 1;
+  int shardThreads = numShards;
+  if (options.count("shard-size")) {
+    TId shardSize = options["shard-size"].as<TId>();
+    if ((numShards > 1) || !shardSize) {
+      cerr << "--shard-size has to be positive and excludes --shards\n";
+      exit(EXIT_FAILURE);
+    }
+    sharded = true;
+    numShards = (uint64_t(numberOfTrajectories) + shardSize - 1) / shardSize;
+    shardThreads = numThreads;
+  }
+  // --joint groups the trajectories by particle
+  int dim = options.count("joint") ? 3 : 1;
+  if (numberOfTrajectories % dim) {
+    cerr << "--joint requires a multiple of 3 trajectories\n";
+    exit(EXIT_FAILURE);
+  }
+  if (options.count("shard-size") && (options["shard-size"].as<TId>() % dim)) {
+    cerr << "--shard-size has to be a multiple of 3 with --joint\n";
+    exit(EXIT_FAILURE);
+  }
+  if (numShards > numberOfTrajectories / dim) {
+    cerr << "--shards must not exceed the number of trajectories (of particles with --joint)\n";
+    exit(EXIT_FAILURE);
+  }
+  uint checkpointInterval = require("checkpoint-interval").as<uint>();
+  if (checkpointInterval && sharded) {
+    cerr << "--checkpoint-interval and --shards are mutually exclusive\n";
+    exit(EXIT_FAILURE);
+  }
+
   /// execute (de)compression
+  Settings settings{numberOfTrajectories, sourceFileHandle, sinkFileHandle,
+		    error, quantum, bound, integerEncoder,
+		    numThreads, numShards, shardThreads, sharded, checkpointInterval,
+		    require("io-buffers").as<int>(), dim, options.count("quadratic") > 0,
+		    options.count("pbc") ? parseBox(options["pbc"].as<string>()) : vector<double>(),
+		    options.count("error-class") ? parseErrorClasses(options["error-class"].as<vector<string>>(), numberOfTrajectories, require("error").as<double>()) : vector<double>(),
+		    options.count("stream-codecs") ? parseCodecs(options["stream-codecs"].as<string>()) : vector<int>()};
+  // single precision formats are processed as float throughout
+  auto fmtString = options["format"].as<string>();
+  bool single = fmtString.size() >= 5 && fmtString.compare(fmtString.size() - 5, 5, "float") == 0;
   if (options.count("decompress")) {
-    auto decompressorFactory = [&]() {
-      return new DecompressorState<double> (numberOfTrajectories, quantum, chunkSize, integer_encoding::EncodingFactory::create(integerEncoder), [=](char* buf) -> ChunkSize {
-	     ChunkSize chunkSize;
-	     if ((read(sourceFileHandle, &chunkSize, sizeof(chunkSize))) == sizeof(chunkSize)) {
-	       assert(read(sourceFileHandle, buf, chunkSize.compressed) == chunkSize.compressed);
-	     }else{
-	       chunkSize.compressed = 0, chunkSize.raw = 0;
-	     }
-	     return chunkSize;
-       });
-    };
-    decompressionLoop<double>(decompressorFactory, numberOfTrajectories, options["blocksize"].as<uint>());
+    if (single) settings.decompress<float>(options);
+    else        settings.decompress<double>(options);
   }else{
-    auto compressorFactory = [&]() {
-      return new CompressorState<double>
-      (numberOfTrajectories, error, bound, quantum, chunkSize, integer_encoding::EncodingFactory::create(integerEncoder), [&](char* buf, ChunkSize chunkSize) {
-	      assert(write(sinkFileHandle, &chunkSize, sizeof(chunkSize)) == sizeof(chunkSize));
-	      assert(write(sinkFileHandle, buf, chunkSize.compressed)     == chunkSize.compressed);
-      });
-    };
-
-    function<bool(double*, TId, int)> format;
-    auto fmtString = options["format"].as<string>();
-    if      (fmtString == "hudouble") { format = readHubin<double>; }
-    else                              { assert(false); }
-
-    compressionLoop<double>(compressorFactory, format, numberOfTrajectories, sourceFileHandle, options["blocksize"].as<uint>());
+    if (single) settings.compress<float>(options);
+    else        settings.compress<double>(options);
   }
 
   return 0;
@@ -0,0 +1,121 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* Incremental (de)compression of trajectories, for use from C and
+   C++ (link with libhrtc.a or libhrtc.so).
+
+   An encoder takes one frame at a time and produces the same stream
+   as "hrtc --compress" (unsharded, with block index), which can be
+   taken out piecewise as soon as it is ready. A decoder takes such a
+   stream in pieces of any size and hands out frames as soon as the
+   block holding them is complete; it takes the options recorded in
+   the stream (--joint, --quadratic, --error-class, --stream-codecs)
+   from there. Neither ever blocks; all buffers passed in are owned by
+   the caller.
+
+   Encoding:
+
+     hrtc_params p;
+     hrtc_params_default(&p);
+     p.num_traj = 3 * atoms; p.bound = box; p.error = 0.01;
+     hrtc_encoder *enc = hrtc_encoder_new(&p);
+     for each frame:
+       hrtc_push_frame(enc, frame);
+       while ((n = hrtc_encoder_read(enc, buf, sizeof(buf)))) write(fd, buf, n);
+     hrtc_encoder_finish(enc);
+     while ((n = hrtc_encoder_read(enc, buf, sizeof(buf)))) write(fd, buf, n);
+     hrtc_encoder_free(enc);
+
+   Decoding:
+
+     hrtc_decoder *dec = hrtc_decoder_new(&p);
+     while ((n = read(fd, buf, sizeof(buf))) > 0) {
+       hrtc_decoder_write(dec, buf, n);
+       while (hrtc_pull_frame(dec, frame) == HRTC_OK) use(frame);
+     }
+     hrtc_decoder_free(dec); */
+
+#ifndef HRTC_H
+#define HRTC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  HRTC_OK         =  0, /* done / a frame was returned */
+  HRTC_NEED_INPUT =  1, /* the decoder needs more of the stream */
+  HRTC_END        =  2, /* the stream has ended */
+  HRTC_ERROR      = -1  /* invalid arguments or call order */
+} hrtc_status;
+
+typedef enum {
+  HRTC_FLOAT  = 0,
+  HRTC_DOUBLE = 1
+} hrtc_precision;
+
+/* same meaning as the command line options of the same name */
+typedef struct {
+  uint32_t num_traj;        /* --numtraj (at most 65535) */
+  double bound;             /* --bound */
+  double error;             /* --error */
+  double qp_ratio;          /* --qp-ratio */
+  uint32_t block_size;      /* --blocksize */
+  int integer_encoding;     /* --integer-encoding */
+  int joint;                /* --joint (non-zero: on; decoders take it from the stream) */
+  int quadratic;            /* --quadratic (non-zero: on; decoders take it from the stream) */
+  double pbc[3];            /* --pbc box lengths (0: not periodic) */
+  hrtc_precision precision; /* type of the frame values passed */
+} hrtc_params;
+
+/* fills in the command line defaults; num_traj, bound and error
+   still have to be set */
+void hrtc_params_default(hrtc_params *params);
+
+typedef struct hrtc_encoder hrtc_encoder;
+typedef struct hrtc_decoder hrtc_decoder;
+
+/* returns NULL if the parameters are invalid */
+hrtc_encoder *hrtc_encoder_new(const hrtc_params *params);
+/* compress a frame of num_traj values (float or double) */
+hrtc_status hrtc_push_frame(hrtc_encoder *enc, const void *frame);
+/* end the stream; no frames may be pushed afterwards */
+hrtc_status hrtc_encoder_finish(hrtc_encoder *enc);
+/* number of compressed bytes ready to be read */
+size_t hrtc_encoder_available(const hrtc_encoder *enc);
+/* take up to size ready bytes into buf; returns their number */
+size_t hrtc_encoder_read(hrtc_encoder *enc, void *buf, size_t size);
+void hrtc_encoder_free(hrtc_encoder *enc);
+
+/* returns NULL if the parameters are invalid */
+hrtc_decoder *hrtc_decoder_new(const hrtc_params *params);
+/* append size bytes of the compressed stream */
+hrtc_status hrtc_decoder_write(hrtc_decoder *dec, const void *data, size_t size);
+/* decode the next frame into frame (num_traj values); returns
+   HRTC_NEED_INPUT if its block is not complete yet */
+hrtc_status hrtc_pull_frame(hrtc_decoder *dec, void *frame);
+void hrtc_decoder_free(hrtc_decoder *dec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
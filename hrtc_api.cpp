@@ -0,0 +1,313 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+// Implementation of the C API in hrtc.h
+
+#include <memory>
+
+#include "hrtc.h"
+#include "common.hpp"
+#include "compressor.hpp"
+#include "decompressor.hpp"
+#include "header.hpp"
+#include "index.hpp"
+#include "pbc.hpp"
+
+namespace {
+
+const int chunkSize = 1024;
+
+// trajectories compressed jointly
+int dim(const hrtc_params *p) { return p->joint ? 3 : 1; }
+
+// trajectory ids are TIds
+bool valid(const hrtc_params *p) {
+  return p && p->num_traj && (p->num_traj <= maxTId) && (p->bound > 0) && (p->error > 0)
+    && (p->qp_ratio > 0) && (p->qp_ratio <= 1) && p->block_size
+    && codecExists(p->integer_encoding)
+    && !(p->num_traj % dim(p))
+    && (p->pbc[0] >= 0) && (p->pbc[1] >= 0) && (p->pbc[2] >= 0)
+    && ((p->precision == HRTC_FLOAT) || (p->precision == HRTC_DOUBLE));
+}
+
+// per trajectory box lengths, empty if not periodic
+template<typename Real>
+vector<Real> periods(const hrtc_params *p) {
+  if (!p->pbc[0] && !p->pbc[1] && !p->pbc[2]) return vector<Real>();
+  return trajectoryPeriods<Real>(vector<double>(p->pbc, p->pbc + 3), p->num_traj);
+}
+
+// split the error as hrtc.cpp does
+double predictionError(const hrtc_params *p) { return p->error * (1 - p->qp_ratio); }
+double quantum(const hrtc_params *p)         { return p->error * p->qp_ratio * 2; }
+
+// length of the chunk at the start of [begin, end); 0 if it is not
+// complete yet
+size_t completeChunk(const char *begin, const char *end) {
+  ChunkSize chunkSize;
+  if (begin + sizeof(chunkSize) > end) return 0;
+  memcpy(&chunkSize, begin, sizeof(chunkSize));
+  if (begin + sizeof(chunkSize) + chunkSize.compressed > end) return 0;
+  return sizeof(chunkSize) + chunkSize.compressed;
+}
+
+// Length of the block (including side chunks before it) at the start
+// of [begin, end); 0 if it is not complete yet. endOfStream is set if
+// the stream ends there instead.
+size_t completeBlock(const char *begin, const char *end, bool &endOfStream) {
+  const char *cur = begin;
+  bool keyFrame = true;
+  endOfStream = false;
+  for (;;) {
+    ChunkSize chunkSize;
+    if (cur + sizeof(chunkSize) > end) return 0;
+    memcpy(&chunkSize, cur, sizeof(chunkSize));
+    if (cur + sizeof(chunkSize) + chunkSize.compressed > end) return 0;
+    cur += sizeof(chunkSize) + chunkSize.compressed;
+    if (isSideChunk(chunkSize)) continue;
+    if (!chunkSize.raw) {
+      endOfStream = keyFrame; // end marker in place of a key frame
+      return cur - begin;
+    }
+    keyFrame = false;
+  }
+}
+
+}
+
+struct hrtc_encoder {
+  hrtc_params params;
+  unique_ptr<CompressorState<float>> compressorFloat;
+  unique_ptr<CompressorState<double>> compressorDouble;
+  unique_ptr<Unwrapper<float>> unwrapFloat;
+  unique_ptr<Unwrapper<double>> unwrapDouble;
+  vector<double> unwrapped; // frame buffer, float or double
+  uint32_t frameInBlock;
+  bool finished;
+  BlockIndex index;
+  vector<char> out;  // produced, not yet read
+  size_t outRead;    // bytes of out already read
+  uint64_t outBase;  // bytes of the stream before out
+
+  void append(const char *buf, size_t size) {
+    out.insert(out.end(), buf, buf + size);
+  }
+
+  void finishBlock() {
+    if (compressorFloat)  compressorFloat->finish();
+    if (compressorDouble) compressorDouble->finish();
+    compressorFloat.reset();
+    compressorDouble.reset();
+    frameInBlock = 0;
+  }
+};
+
+struct hrtc_decoder {
+  hrtc_params params;
+  vector<char> in;    // received, not yet decoded
+  vector<char> block; // being decoded
+  bool headerRead;
+  unique_ptr<DecompressorState<float>> decompressorFloat;
+  unique_ptr<DecompressorState<double>> decompressorDouble;
+  vector<float> periodFloat;
+  vector<double> periodDouble;
+  vector<double> errorScale; // from the stream, empty if none
+  vector<int> streamCodecs;  // from the stream, empty if none
+  bool ended;
+};
+
+extern "C" {
+
+void hrtc_params_default(hrtc_params *params) {
+  params->num_traj = 0;
+  params->bound = 0;
+  params->error = 0;
+  params->qp_ratio = 0.1;
+  params->block_size = 1024;
+  params->integer_encoding = 14;
+  params->joint = 0;
+  params->quadratic = 0;
+  params->pbc[0] = params->pbc[1] = params->pbc[2] = 0;
+  params->precision = HRTC_DOUBLE;
+}
+
+hrtc_encoder *hrtc_encoder_new(const hrtc_params *params) {
+  if (!valid(params)) return nullptr;
+  hrtc_encoder *enc = new hrtc_encoder();
+  enc->params = *params;
+  enc->frameInBlock = 0;
+  enc->finished = false;
+  enc->outRead = 0;
+  enc->outBase = 0;
+  if (periods<double>(params).size()) {
+    if (params->precision == HRTC_FLOAT)
+      enc->unwrapFloat.reset(new Unwrapper<float>(periods<float>(params)));
+    else
+      enc->unwrapDouble.reset(new Unwrapper<double>(periods<double>(params)));
+    enc->unwrapped.resize(params->num_traj);
+  }
+  StreamParams{TId(params->num_traj), params->joint != 0, params->quadratic != 0, {}, {}, params->block_size}.write([enc](const char *buf, size_t size) { enc->append(buf, size); });
+  return enc;
+}
+
+hrtc_status hrtc_push_frame(hrtc_encoder *enc, const void *frame) {
+  if (!enc || !frame || enc->finished) return HRTC_ERROR;
+  const hrtc_params *p = &enc->params;
+  if (!enc->frameInBlock) {
+    enc->index.addBlock(enc->outBase + enc->out.size(), enc->index.numFrames);
+    ChunkSink sink = [enc](char *buf, ChunkSize chunkSize) {
+      enc->append((char*) &chunkSize, sizeof(chunkSize));
+      enc->append(buf, chunkSize.compressed);
+    };
+    auto codec = createCodec(p->integer_encoding);
+    if (p->precision == HRTC_FLOAT)
+      enc->compressorFloat.reset(new CompressorState<float>(p->num_traj, predictionError(p), p->bound, quantum(p), chunkSize, codec, sink, dim(p), p->quadratic));
+    else
+      enc->compressorDouble.reset(new CompressorState<double>(p->num_traj, predictionError(p), p->bound, quantum(p), chunkSize, codec, sink, dim(p), p->quadratic));
+    if (enc->unwrapFloat)  enc->unwrapFloat->reset();
+    if (enc->unwrapDouble) enc->unwrapDouble->reset();
+  }
+  if (enc->unwrapFloat) {
+    (*enc->unwrapFloat)((const float*) frame, (float*) enc->unwrapped.data());
+    frame = enc->unwrapped.data();
+  }
+  if (enc->unwrapDouble) {
+    (*enc->unwrapDouble)((const double*) frame, enc->unwrapped.data());
+    frame = enc->unwrapped.data();
+  }
+  if (p->precision == HRTC_FLOAT)
+    enc->compressorFloat->addFrame((const float*) frame);
+  else
+    enc->compressorDouble->addFrame((const double*) frame);
+  enc->index.numFrames++;
+  if (++enc->frameInBlock == p->block_size)
+    enc->finishBlock();
+  return HRTC_OK;
+}
+
+hrtc_status hrtc_encoder_finish(hrtc_encoder *enc) {
+  if (!enc || enc->finished) return HRTC_ERROR;
+  enc->finishBlock();
+  enc->index.write([enc](const char *buf, size_t size) { enc->append(buf, size); });
+  enc->finished = true;
+  return HRTC_OK;
+}
+
+size_t hrtc_encoder_available(const hrtc_encoder *enc) {
+  return enc ? enc->out.size() - enc->outRead : 0;
+}
+
+size_t hrtc_encoder_read(hrtc_encoder *enc, void *buf, size_t size) {
+  size_t n = min(size, hrtc_encoder_available(enc));
+  if (!n) return 0;
+  memcpy(buf, enc->out.data() + enc->outRead, n);
+  enc->outRead += n;
+  // drop what was read once it is the larger part of the buffer
+  if (2 * enc->outRead >= enc->out.size()) {
+    enc->out.erase(enc->out.begin(), enc->out.begin() + enc->outRead);
+    enc->outBase += enc->outRead;
+    enc->outRead = 0;
+  }
+  return n;
+}
+
+void hrtc_encoder_free(hrtc_encoder *enc) {
+  delete enc;
+}
+
+hrtc_decoder *hrtc_decoder_new(const hrtc_params *params) {
+  if (!valid(params)) return nullptr;
+  hrtc_decoder *dec = new hrtc_decoder();
+  dec->params = *params;
+  dec->headerRead = false;
+  dec->ended = false;
+  if (params->precision == HRTC_FLOAT)
+    dec->periodFloat = periods<float>(params);
+  else
+    dec->periodDouble = periods<double>(params);
+  return dec;
+}
+
+hrtc_status hrtc_decoder_write(hrtc_decoder *dec, const void *data, size_t size) {
+  if (!dec || (!data && size)) return HRTC_ERROR;
+  dec->in.insert(dec->in.end(), (const char*) data, (const char*) data + size);
+  return HRTC_OK;
+}
+
+hrtc_status hrtc_pull_frame(hrtc_decoder *dec, void *frame) {
+  if (!dec || !frame) return HRTC_ERROR;
+  const hrtc_params *p = &dec->params;
+  for (;;) {
+    if (dec->decompressorFloat && dec->decompressorFloat->readFrame((float*) frame)) {
+      if (dec->periodFloat.size())
+	wrapFrame(dec->periodFloat.data(), (float*) frame, p->num_traj);
+      return HRTC_OK;
+    }
+    if (dec->decompressorDouble && dec->decompressorDouble->readFrame((double*) frame)) {
+      if (dec->periodDouble.size())
+	wrapFrame(dec->periodDouble.data(), (double*) frame, p->num_traj);
+      return HRTC_OK;
+    }
+    dec->decompressorFloat.reset();
+    dec->decompressorDouble.reset();
+    if (dec->ended) return HRTC_END;
+
+    // the stream overrides the parameters it records
+    if (!dec->headerRead) {
+      const char *cur = dec->in.data(), *end = cur + dec->in.size();
+      if (!completeChunk(cur, end)) return HRTC_NEED_INPUT;
+      StreamParams params;
+      if (!params.read(cur, end) || (params.numTraj != p->num_traj)) return HRTC_ERROR;
+      dec->params.joint = params.joint;
+      dec->params.quadratic = params.quadratic;
+      dec->errorScale = params.errorScale;
+      for (int id : params.streamCodecs)
+	if (!codecExists(id)) return HRTC_ERROR;
+      dec->streamCodecs = params.streamCodecs;
+      dec->in.erase(dec->in.begin(), dec->in.begin() + (cur - dec->in.data()));
+      dec->headerRead = true;
+    }
+
+    // start the next block once it is complete; it is moved out of
+    // in, which may grow (and move) while it is decoded
+    bool endOfStream;
+    size_t size = completeBlock(dec->in.data(), dec->in.data() + dec->in.size(), endOfStream);
+    if (!size) return HRTC_NEED_INPUT;
+    if (endOfStream) {
+      // the block index follows, which is of no use here
+      dec->ended = true;
+      dec->in.clear();
+      return HRTC_END;
+    }
+    dec->block.assign(dec->in.begin(), dec->in.begin() + size);
+    dec->in.erase(dec->in.begin(), dec->in.begin() + size);
+    ChunkSource src = readChunks(dec->block.data(), dec->block.data() + dec->block.size());
+    auto codec = dec->streamCodecs.empty() ? createCodec(p->integer_encoding) : CodecPtr(new SelectCodec(dec->streamCodecs));
+    const double *scale = dec->errorScale.empty() ? nullptr : dec->errorScale.data();
+    if (p->precision == HRTC_FLOAT)
+      dec->decompressorFloat.reset(new DecompressorState<float>(p->num_traj, quantum(p), chunkSize, codec, src, dim(p), p->quadratic, scale));
+    else
+      dec->decompressorDouble.reset(new DecompressorState<double>(p->num_traj, quantum(p), chunkSize, codec, src, dim(p), p->quadratic, scale));
+  }
+}
+
+void hrtc_decoder_free(hrtc_decoder *dec) {
+  delete dec;
+}
+
+}
@@ -19,12 +19,22 @@
 #include "common.hpp"
 #include "compressor.hpp"
 #include "decompressor.hpp"
+#include "parallel.hpp"
+#include "pbc.hpp"
 
 
 extern "C" {
 	#include <tng/tng_io.h>
 }
 
+	// Periodic boundaries (see pbc.hpp) are off unless switched on by
+	// hrtc_set_pbc(): decompression wraps all coordinates into the box,
+	// which e.g. breaks up molecules that were made whole. Framesets
+	// compressed with them start with -quantum and the box lengths
+	// instead of quantum, so that older versions reject them. The box
+	// must not change within such a frameset.
+	static bool use_pbc = false;
+
 	template<typename T>
 	tng_function_status typed_hrtc_compress(const tng_trajectory_t tng_data,
 							const int64_t n_frames,
@@ -33,23 +43,35 @@ extern "C" {
 							int64_t *new_len) {
 		int64_t dimensions;
 		double bound = 0,error = 0,quantum = 0;
+		vector<double> box;
 
 		{// this block: read number of dimensions + read box shape to calculate bound
 	     // this is done here, because tng_data_block_write does not know about
 		 // these things and thus cannot pass it
 			char type;
 			union data_values **box_data = 0;
-			int64_t dummy,current_dimension;
+			int64_t box_frames,current_dimension;
 
-			tng_function_status stat=tng_data_get(tng_data,TNG_TRAJ_BOX_SHAPE,&box_data,&dummy,&dimensions,&type);
+			tng_function_status stat=tng_data_get(tng_data,TNG_TRAJ_BOX_SHAPE,&box_data,&box_frames,&dimensions,&type);
 			assert(stat == TNG_SUCCESS);
 			assert(dimensions>0);
+			assert(box_frames>0);
 
 			double val = 0; // current dimension value in loop
 			for (current_dimension=0; current_dimension<dimensions;current_dimension++){
 				val=(type==TNG_DOUBLE_DATA)?box_data[0][current_dimension].d:box_data[0][current_dimension].f;
 				assert(val>0);
-				bound = max(val,bound);
+				box.push_back(val);
+			}
+
+			// the bound has to hold for the largest box of the frameset;
+			// the periods are stored once, so they must not change
+			for (int64_t box_frame=0; box_frame<box_frames; box_frame++){
+				for (current_dimension=0; current_dimension<dimensions;current_dimension++){
+					val=(type==TNG_DOUBLE_DATA)?box_data[box_frame][current_dimension].d:box_data[box_frame][current_dimension].f;
+					if (use_pbc && (val != box[current_dimension])) return TNG_FAILURE;
+					bound = max(val,bound);
+				}
 			}
 		}
 
@@ -64,69 +86,62 @@ extern "C" {
 			assert(quantum>0);
 		}
 
-		char* result = nullptr;
-		size_t result_size=sizeof(double); // for quantum
-		result=(char*) malloc(result_size); // allocate memory for one double
-		memcpy(result,&quantum,result_size); // copy double to result data
+		int numberOfTrajectories=n_particles*dimensions;
+
+		// grows geometrically; presizing it from the raw size does not
+		// pay off (see microbench arena)
+		ChunkArena result;
+		auto traj_data=(T*) *data;
+		if (use_pbc) {
+			// *data is freed below, so it is unwrapped in place
+			Unwrapper<T> unwrap(trajectoryPeriods<T>(box, numberOfTrajectories));
+			for (int64_t frame_number=0;frame_number<n_frames;frame_number++)
+				unwrap(traj_data+frame_number*numberOfTrajectories, traj_data+frame_number*numberOfTrajectories);
+			double marker = -quantum;
+			result.append(&marker, sizeof(double));
+			result.append(box.data(), box.size() * sizeof(double));
+		}else{
+			result.append(&quantum, sizeof(double));
+		}
 
 		int integerEncoder = 5; // pareto optimal / good space-time tradeoff
-		int numberOfTrajectories=n_particles*dimensions;
 
 		CompressorState<T> compressor(numberOfTrajectories,
 									  error,
 									  bound,
 									  quantum,
 									  1024 /* chunk size */,
-									  integer_encoding::EncodingFactory::create(integerEncoder),
-									  [&](char* buf, ChunkSize chunkSize) {
-											auto offset=result_size;
-										  	result_size+= sizeof(chunkSize) + chunkSize.compressed;
-										  	result = (char*) realloc(result,result_size);
-//										  	printf("chunksize: %d (raw) => %d (compressed), offset: %d\n",chunkSize.raw,chunkSize.compressed,offset);
-										  	memcpy((void*)(result+offset),(void*)&chunkSize,sizeof(chunkSize));
-										  	offset+=sizeof(chunkSize);
-										  	memcpy((void*)(result+offset),(void*)buf,chunkSize.compressed);
-									  });
+									  createCodec(integerEncoder),
+									  appendChunks(result));
 
-		auto traj_data=(T*) *data;
 		for (int64_t frame_number=0;frame_number<n_frames;frame_number++){ // loop through frames
 			compressor.addFrame(traj_data+frame_number*numberOfTrajectories);
 		}
 		compressor.finish();
 
 	    free(*data);
-	    *data = (char *)result;
-	    *new_len = result_size;
+	    *new_len = result.size;
+	    *data = result.release();
 
 		return TNG_SUCCESS;
 	}
 
-	template<typename T>
-	tng_function_status typed_hrtc_uncompress(const tng_trajectory_t tng_data,
-            char **data) {
-
+	// shape of the framesets of a trajectory as needed for decompression
+	struct FramesetShape {
+		int64_t number_of_frames, number_of_trajectories, dimensions;
+	};
 
+	FramesetShape frameset_shape(const tng_trajectory_t tng_data) {
 		int64_t dimensions,number_of_frames,number_of_particles;
-		double bound = 0,error = 0,quantum = 0;
-
-		int integerEncoder = 5; // pareto optimal / good space-time tradeoff
 
-		{// this block: read number of dimensions + number of frames + box shape to calculate bound
+		{// this block: read number of dimensions + number of frames
 			char type;
 			union data_values **box_data = 0;
-			int64_t current_dimension;
 
 			tng_function_status stat=tng_data_get(tng_data,TNG_TRAJ_BOX_SHAPE,&box_data,&number_of_frames,&dimensions,&type);
 			assert(stat == TNG_SUCCESS);
 			assert(dimensions>0);
 			assert(number_of_frames>0);
-
-			double val = 0; // current dimension value in loop
-			for (current_dimension=0; current_dimension<dimensions;current_dimension++){
-				val=(type==TNG_DOUBLE_DATA)?box_data[0][current_dimension].d:box_data[0][current_dimension].f;
-				assert(val>0);
-				bound = max(val,bound);
-			}
 		}
 
 		{ // this block: determine number of particles
@@ -141,42 +156,72 @@ extern "C" {
 			assert(number_of_frames>0);
 		}
 
+		FramesetShape shape;
+		shape.number_of_frames = number_of_frames;
+		shape.number_of_trajectories = number_of_particles*dimensions;
+		shape.dimensions = dimensions;
+		return shape;
+	}
 
-		int number_of_trajectories=number_of_particles*dimensions;
-		auto src_buf = *data;
-
+	// Decode the compressed frameset src into dst (frames one after
+	// another). The chunks are decoded straight from src.
+	template<typename T>
+	tng_function_status typed_hrtc_uncompress_into(const FramesetShape &shape,
+            const char *src, T *dst) {
+		int integerEncoder = 5; // pareto optimal / good space-time tradeoff
+		double quantum = 0;
+		auto src_buf = src;
 
-		{ // this block: read quantum from data blob, set error
-			quantum = *((double*) src_buf); // reading quantum from tip of data blob
+		vector<T> period;
+		{ // this block: read quantum (and box, if negative) from data blob
+			memcpy(&quantum, src_buf, sizeof(double)); // reading quantum from tip of data blob
 			src_buf+=sizeof(double); // moving pointer ahead
-			error       = quantum/2;
-			assert(error>0);
+			if (quantum < 0) {
+				quantum = -quantum;
+				vector<double> box(shape.dimensions);
+				memcpy(box.data(), src_buf, box.size() * sizeof(double));
+				src_buf += box.size() * sizeof(double);
+				period = trajectoryPeriods<T>(box, shape.number_of_trajectories);
+			}
 			assert(quantum>0);
 		}
 
-		DecompressorState<T> decompressor(number_of_trajectories,
+		DecompressorState<T> decompressor(shape.number_of_trajectories,
 				quantum,
 				1024 /* chunk size */,
-				integer_encoding::EncodingFactory::create(integerEncoder),
-				[&](char* buf) -> ChunkSize {
-					ChunkSize chunkSize = *((ChunkSize*) src_buf);
+				createCodec(integerEncoder),
+				[&](char*, const char *&chunk) -> ChunkSize {
+					ChunkSize chunkSize;
+					memcpy(&chunkSize, src_buf, sizeof(chunkSize));
 					src_buf += sizeof(chunkSize);
-//				  	printf("chunksize: %d (compressed) => %d (raw)\n",chunkSize.compressed,chunkSize.raw);
-//				  	printf("src_buf: %d\n",src_buf-*data);
-					memcpy(buf,src_buf,chunkSize.compressed);
+					chunk = src_buf; // decoded in place
 					src_buf += chunkSize.compressed;
 
 					return chunkSize;
 		       	  });
 
-		auto result = (T*) malloc(number_of_frames * number_of_trajectories * sizeof(T));
-		auto result_pos = result;
+		auto result_pos = dst;
+		for (int64_t i=0; i<shape.number_of_frames;i++){
+			if (!decompressor.readFrame(result_pos)) return TNG_FAILURE; // frameset too short
+			if (period.size())
+				wrapFrame(period.data(), result_pos, shape.number_of_trajectories);
+			result_pos += shape.number_of_trajectories;
+		}
+		if (decompressor.readFrame(nullptr)) return TNG_FAILURE; // frameset too long
 
-		for (int i=0; i<number_of_frames;i++){
-			assert(decompressor.readFrame(result_pos)); // should not be activated unless all frames have been read.
-			result_pos += number_of_trajectories;
+		return TNG_SUCCESS;
+	}
+
+	template<typename T>
+	tng_function_status typed_hrtc_uncompress(const tng_trajectory_t tng_data,
+            char **data) {
+		FramesetShape shape = frameset_shape(tng_data);
+		auto result = (T*) malloc(shape.number_of_frames * shape.number_of_trajectories * sizeof(T));
+		tng_function_status stat = typed_hrtc_uncompress_into<T>(shape, *data, result);
+		if (stat != TNG_SUCCESS) {
+			free(result);
+			return stat;
 		}
-		assert(!decompressor.readFrame(result_pos)); // if we have not read all frames, something went wrong
 
 	    free(*data);
 
@@ -185,6 +230,31 @@ extern "C" {
 		return TNG_SUCCESS;
 	}
 
+	// Decode count framesets concurrently, one thread per frameset at
+	// a time. Frameset i holds n_frames[i] frames (the last one of a
+	// trajectory is usually shorter).
+	template<typename T>
+	tng_function_status typed_hrtc_uncompress_many(const tng_trajectory_t tng_data,
+            int64_t count, const int64_t *n_frames, const char **src, void **dst, int threads) {
+		FramesetShape shape = frameset_shape(tng_data);
+		for (int64_t i=0; i<count; i++)
+			if (n_frames[i] <= 0) return TNG_FAILURE;
+		if (threads <= 0) threads = thread::hardware_concurrency();
+		threads = max<int64_t>(1, min<int64_t>(threads, count));
+		vector<tng_function_status> stat(count, TNG_SUCCESS);
+		ForkJoin pool(threads);
+		pool.run([&](int t) {
+			FramesetShape own = shape;
+			for (int64_t i=t; i<count; i+=threads) {
+				own.number_of_frames = n_frames[i];
+				stat[i] = typed_hrtc_uncompress_into<T>(own, src[i], (T*) dst[i]);
+			}
+		});
+		for (auto s : stat)
+			if (s != TNG_SUCCESS) return s;
+		return TNG_SUCCESS;
+	}
+
 extern "C" {
 	tng_function_status hrtc_compress(const tng_trajectory_t tng_data,
 			const int64_t n_frames,
@@ -216,6 +286,43 @@ extern "C" {
 		}
 	}
 
+	/* decompression of count framesets src[i] of n_frames[i] frames
+	   each into dst[i] by up to threads threads (0: one per core) */
+	tng_function_status hrtc_uncompress_many(const tng_trajectory_t tng_data,
+            const char type,
+            const int64_t count,
+            const int64_t *n_frames,
+            const char **src,
+            void **dst,
+            const int threads) {
+		switch (type){
+			case TNG_DOUBLE_DATA:
+				return typed_hrtc_uncompress_many<double>(tng_data,count,n_frames,src,dst,threads);
+			case TNG_FLOAT_DATA:
+				return typed_hrtc_uncompress_many<float>(tng_data,count,n_frames,src,dst,threads);
+			default:
+				return TNG_FAILURE;
+		}
+	}
+
+	/* decompression of a frameset of n_frames frames into caller
+	   memory dst, which has to hold them; src is left untouched. Fails
+	   unless the frameset holds exactly n_frames frames. */
+	tng_function_status hrtc_uncompress_into(const tng_trajectory_t tng_data,
+            const char type,
+            const int64_t n_frames,
+            const char *src,
+            void *dst) {
+		return hrtc_uncompress_many(tng_data,type,1,&n_frames,&src,&dst,1);
+	}
+
+	/* compress framesets compressed from now on unwrapped across the
+	   periodic box (non-zero) or as they are (0, the default);
+	   hrtc_compress then fails for framesets whose box changes */
+	void hrtc_set_pbc(const int enable){
+		use_pbc = enable;
+	}
+
 	void hrtc_version(){
 		cout << hrtc_version_string() << "\n";
 	}
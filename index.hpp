@@ -0,0 +1,102 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "common.hpp"
+
+// Block index, written after the last block of a stream:
+//
+//   end marker (an empty ChunkSize), BlockIndexEntry[numBlocks], BlockIndexTrailer
+//
+// A sequential decoder reads the end marker in place of the next key
+// frame (or shard directory) and stops. A seeking decoder reads the
+// trailer from the end of the file and jumps straight to the block
+// holding the frame it wants.
+struct BlockIndexEntry {
+  uint64_t offset;      // byte offset of the block in the stream
+  uint64_t firstFrame;  // number of the first frame in the block
+  uint64_t checkpoints; // byte offset of its checkpoint chunk, 0 if none
+};
+
+struct BlockIndexTrailer {
+  uint64_t numBlocks;
+  uint64_t numFrames;
+  uint64_t magic;
+};
+
+const uint64_t blockIndexMagic = 0x3158444943545248; // "HRTCIDX1"
+
+struct BlockIndex {
+  vector<BlockIndexEntry> blocks;
+  uint64_t numFrames;
+
+  BlockIndex() : numFrames(0) {}
+
+  void addBlock(uint64_t offset, uint64_t firstFrame, uint64_t checkpoints = 0) {
+    BlockIndexEntry entry;
+    entry.offset = offset;
+    entry.firstFrame = firstFrame;
+    entry.checkpoints = checkpoints;
+    blocks.push_back(entry);
+  }
+
+  void write(function<void(const char*, size_t)> out) const {
+    ChunkSize endMarker;
+    endMarker.raw = endMarker.compressed = 0;
+    out((char*) &endMarker, sizeof(endMarker));
+    out((char*) blocks.data(), sizeof(BlockIndexEntry) * blocks.size());
+    BlockIndexTrailer trailer;
+    trailer.numBlocks = blocks.size();
+    trailer.numFrames = numFrames;
+    trailer.magic = blockIndexMagic;
+    out((char*) &trailer, sizeof(trailer));
+  }
+
+  // Read the index from the end of a seekable file. Returns false if
+  // there is none.
+  bool read(int fd) {
+    struct stat st;
+    BlockIndexTrailer trailer;
+    if (fstat(fd, &st) || (uint64_t(st.st_size) < sizeof(trailer))) return false;
+    uint64_t pos = st.st_size - sizeof(trailer);
+    if (pread(fd, &trailer, sizeof(trailer), pos) != sizeof(trailer)) return false;
+    if (trailer.magic != blockIndexMagic) return false;
+    if (trailer.numBlocks * sizeof(BlockIndexEntry) > pos) return false;
+    blocks.resize(trailer.numBlocks);
+    pos -= sizeof(BlockIndexEntry) * trailer.numBlocks;
+    size_t size = sizeof(BlockIndexEntry) * trailer.numBlocks;
+    if (pread(fd, blocks.data(), size, pos) != ssize_t(size)) return false;
+    numFrames = trailer.numFrames;
+    return true;
+  }
+
+  // number of the block that contains frame (frame < numFrames)
+  size_t find(uint64_t frame) const {
+    assert(frame < numFrames);
+    auto it = upper_bound(blocks.begin(), blocks.end(), frame,
+			  [](uint64_t f, const BlockIndexEntry &e) { return f < e.firstFrame; });
+    return it - blocks.begin() - 1;
+  }
+};
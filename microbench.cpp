@@ -0,0 +1,377 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+// Micro benchmarks of isolated compressor components. Usage:
+//   ./microbench <component> [args...]
+
+#include <map>
+#include <random>
+#include <vector>
+
+#include "common.hpp"
+#include "compressor.hpp"
+#include "decompressor.hpp"
+#include "perftools.hpp"
+#include "schedule.hpp"
+
+/// segment scheduler
+
+// The scheduler as it was before SegmentSchedule: a map of known and
+// a binary heap of expected segments. Kept as reference.
+struct LegacySchedule {
+  priority_queue<STP, priority_queue<STP>::container_type, std::greater<STP>> expectedSegment;
+  map<STP, SVI> knownSegment;
+
+  template<typename Emit>
+  void know(STP stp, SVI svi, Emit emit) {
+    knownSegment.insert(make_pair(stp, svi));
+    while (expectedSegment.size() && (expectedSegment.top() == knownSegment.begin()->first)) {
+      auto segIter = knownSegment.begin();
+      STP newSeg;
+      newSeg.time = segIter->first.time + segIter->second.dt + 1;
+      newSeg.id = expectedSegment.top().id;
+      expectedSegment.push(newSeg);
+      emit(segIter->second);
+      knownSegment.erase(segIter);
+      expectedSegment.pop();
+    }
+  }
+};
+
+// Replays the segment pattern of numTraj trajectories with
+// geometrically distributed segment lengths through both schedulers
+// and compares their output order.
+int benchScheduler(int argc, char **argv) {
+  TId numTraj  = argc > 0 ? atoi(argv[0]) : 30000;
+  Time frames  = argc > 1 ? atoi(argv[1]) : 1024;
+  double meanDt = argc > 2 ? atof(argv[2]) : 8;
+
+  // precompute the frames at which each trajectory closes a segment
+  mt19937 rng(42);
+  geometric_distribution<int> segLen(1 / meanDt);
+  vector<vector<TId>> closing(frames);
+  for (TId id=0; id<numTraj; id++) {
+    for (Time t = 1 + segLen(rng) + 1; t < frames; t += segLen(rng) + 1)
+      closing[t].push_back(id);
+  }
+
+  uint64_t legacySum = 0, newSum = 0, count = 0;
+  double legacyTime, newTime;
+
+  { // legacy
+    Timer timer;
+    LegacySchedule s;
+    vector<Time> t0(numTraj, 0);
+    for (TId id=0; id<numTraj; id++) {
+      STP stp; stp.time = 1; stp.id = id;
+      s.expectedSegment.push(stp);
+    }
+    for (Time t=1; t<frames; t++) {
+      for (TId id : closing[t]) {
+	SVI svi; svi.dt = t - 1 - t0[id] - 1; svi.v = id;
+	STP stp; stp.time = t0[id] + 1; stp.id = id;
+	t0[id] = t - 1;
+	s.know(stp, svi, [&](SVI svi) { legacySum = legacySum * 31 + svi.v; count++; });
+      }
+    }
+    legacyTime = timer.diff();
+  }
+
+  { // SegmentSchedule
+    Timer timer;
+    SegmentSchedule s(numTraj);
+    vector<Time> t0(numTraj, 0);
+    for (TId id=0; id<numTraj; id++) {
+      STP stp; stp.time = 1; stp.id = id;
+      s.expect(stp);
+    }
+    for (Time t=1; t<frames; t++) {
+      for (TId id : closing[t]) {
+	SVI svi; svi.dt = t - 1 - t0[id] - 1; svi.v = id;
+	t0[id] = t - 1;
+	s.know(id, svi);
+	while (s.ready())
+	  newSum = newSum * 31 + s.next().v;
+      }
+    }
+    newTime = timer.diff();
+  }
+
+  if (legacySum != newSum) {
+    cerr << "scheduler output order differs\n";
+    return EXIT_FAILURE;
+  }
+  print_throughput(legacyTime, count, "map/priority_queue SVI");
+  print_throughput(newTime,    count, "SegmentSchedule SVI");
+  return EXIT_SUCCESS;
+}
+
+/// frame reconstruction
+
+// The per-trajectory decoder state as it was before DecompTrajState
+// became a structure of arrays. Kept as reference.
+struct LegacyDecompTrajState {
+  Time t0, dt;
+  int x0, dx;
+
+  double get(Time t1, double quantum) {
+    return dt
+      ?                     quant2real<double>(x0, quantum)
+        + double(t1 - t0) * quant2real<double>(dx, quantum) / dt
+      : quant2real<double>(x0, quantum);
+  }
+};
+
+// Reconstructs frames from random segments with both decoder states
+// and compares the results.
+int benchReconstruct(int argc, char **argv) {
+  TId numTraj = argc > 0 ? atoi(argv[0]) : 60000;
+  Time frames = argc > 1 ? atoi(argv[1]) : 1024;
+  double quantum = 0.01;
+
+  mt19937 rng(42);
+  uniform_int_distribution<int> x(-10000, 10000), dx(-100, 100);
+  uniform_int_distribution<uint32_t> dt(1, 64);
+  vector<LegacyDecompTrajState> legacy(numTraj);
+  DecompTrajState<double> state(numTraj);
+  for (TId i=0; i<numTraj; i++) {
+    LegacyDecompTrajState &l = legacy[i];
+    l.t0 = 0; l.dt = dt(rng); l.x0 = x(rng); l.dx = dx(rng);
+    state.set(i, l.t0, l.dt, l.x0, l.dx, quantum);
+  }
+
+  vector<double> legacyFrame(numTraj), newFrame(numTraj);
+  double legacyErr = 0, legacyTime, newTime;
+  { // legacy
+    Timer timer;
+    for (Time t=0; t<frames; t++) {
+      for (TId i=0; i<numTraj; i++)
+	legacyFrame[i] = legacy[i].get(t, quantum);
+      legacyErr += legacyFrame[t % numTraj];
+    }
+    legacyTime = timer.diff();
+  }
+  { // DecompTrajState
+    Timer timer;
+    for (Time t=0; t<frames; t++) {
+      state.get(t, newFrame.data());
+      legacyErr -= newFrame[t % numTraj];
+    }
+    newTime = timer.diff();
+  }
+
+  if (fabs(legacyErr) > 1e-6 * frames) {
+    cerr << "reconstructed frames differ\n";
+    return EXIT_FAILURE;
+  }
+  // untimed: every value of every frame, up to the rounding of the
+  // two formulas
+  for (Time t=0; t<frames; t++) {
+    state.get(t, newFrame.data());
+    for (TId i=0; i<numTraj; i++) {
+      double v = legacy[i].get(t, quantum);
+      if (fabs(newFrame[i] - v) > 1e-9 * (1 + fabs(v))) {
+	cerr << "frame " << t << " differs in trajectory " << i << ": " << newFrame[i] << " instead of " << v << endl;
+	return EXIT_FAILURE;
+      }
+    }
+  }
+  print_throughput(legacyTime, double(frames) * numTraj, "per-trajectory get() value");
+  print_throughput(newTime,    double(frames) * numTraj, "DecompTrajState::get value");
+  return EXIT_SUCCESS;
+}
+
+/// output arena
+
+// Appends the chunks of a compressed frameset the way the TNG wrapper
+// did before ChunkArena: one realloc() per chunk. Kept as reference.
+char *legacyAppend(const vector<pair<ChunkSize, const char*>> &chunks, size_t &size) {
+  size = sizeof(double);
+  char *result = (char*) malloc(size);
+  for (auto &c : chunks) {
+    auto offset = size;
+    size += sizeof(c.first) + c.first.compressed;
+    result = (char*) realloc(result, size);
+    memcpy(result + offset, &c.first, sizeof(c.first));
+    memcpy(result + offset + sizeof(c.first), c.second, c.first.compressed);
+  }
+  return result;
+}
+
+// Compresses a frameset of randomly accelerated particles once and
+// replays its chunks into the legacy realloc() sink and a ChunkArena.
+int benchArena(int argc, char **argv) {
+  TId numTraj = argc > 0 ? atoi(argv[0]) : 30000;
+  Time frames = argc > 1 ? atoi(argv[1]) : 1000;
+  int repeat  = argc > 2 ? atoi(argv[2]) : 20;
+
+  vector<char> stream;
+  {
+    mt19937 rng(42);
+    normal_distribution<float> accel(0, 0.001);
+    vector<float> frame(numTraj, 0), v(numTraj, 0);
+    CompressorState<float> compressor(numTraj, 0.009, 100, 0.002, 1024,
+				      createCodec(5),
+				      appendChunks(stream));
+    for (Time t=0; t<frames; t++) {
+      for (TId i=0; i<numTraj; i++)
+	frame[i] += v[i] += accel(rng);
+      compressor.addFrame(frame.data());
+    }
+    compressor.finish();
+  }
+  vector<pair<ChunkSize, const char*>> chunks;
+  for (const char *cur = stream.data(), *data; ; ) {
+    ChunkSize chunkSize = nextChunk(cur, stream.data() + stream.size(), data);
+    if (!chunkSize.raw) break;
+    chunks.push_back(make_pair(chunkSize, data));
+  }
+
+  size_t legacySize = 0, arenaSize = 0;
+  double legacyTime, arenaTime;
+  { // legacy
+    Timer timer;
+    for (int r=0; r<repeat; r++)
+      free(legacyAppend(chunks, legacySize));
+    legacyTime = timer.diff();
+  }
+  { // ChunkArena
+    Timer timer;
+    for (int r=0; r<repeat; r++) {
+      ChunkArena arena;
+      double quantum = 0.002;
+      arena.append(&quantum, sizeof(quantum));
+      ChunkSink sink = appendChunks(arena);
+      for (auto &c : chunks)
+	sink((char*) c.second, c.first);
+      arenaSize = arena.size;
+      free(arena.release());
+    }
+    arenaTime = timer.diff();
+  }
+  if (legacySize != arenaSize) {
+    cerr << "output sizes differ\n";
+    return EXIT_FAILURE;
+  }
+  cerr << chunks.size() << " chunks, " << legacySize << " bytes\n";
+  print_throughput(legacyTime,   double(repeat) * chunks.size(), "realloc per chunk");
+  print_throughput(arenaTime,    double(repeat) * chunks.size(), "ChunkArena chunk");
+  return EXIT_SUCCESS;
+}
+
+/// SVI codecs
+
+// Records the arrays a compressor passes to its codec.
+struct RecordingCodec : Codec {
+  CodecPtr codec;
+  vector<vector<uint32_t>> &arrays;
+
+  RecordingCodec(CodecPtr codec, vector<vector<uint32_t>> &arrays) : codec(codec), arrays(arrays) {}
+
+  void encodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t *nvalue) const {
+    arrays.push_back(vector<uint32_t>(in, in + len));
+    codec->encodeArray(in, len, out, nvalue);
+  }
+  void decodeArray(const uint32_t *in, uint64_t len, uint32_t *out, uint64_t nvalue) const {
+    codec->decodeArray(in, len, out, nvalue);
+  }
+  uint64_t require(uint64_t len) const { return codec->require(len); }
+};
+
+// Compresses randomly accelerated particles once, recording the SVI
+// chunks, and encodes and decodes them with each codec id given
+// (default: 5 14 and rANS).
+int benchCodec(int argc, char **argv) {
+  TId numTraj = argc > 0 ? atoi(argv[0]) : 30000;
+  Time frames = argc > 1 ? atoi(argv[1]) : 1000;
+  vector<int> ids;
+  for (int i=2; i<argc; i++)
+    ids.push_back(atoi(argv[i]));
+  if (ids.empty())
+    ids = {5, 14, ransCodecId};
+
+  vector<vector<uint32_t>> arrays;
+  {
+    mt19937 rng(42);
+    normal_distribution<float> accel(0, 0.001);
+    vector<float> frame(numTraj, 0), v(numTraj, 0);
+    vector<char> stream;
+    CompressorState<float> compressor(numTraj, 0.009, 100, 0.002, 1024,
+				      CodecPtr(new RecordingCodec(createCodec(ransCodecId), arrays)),
+				      appendChunks(stream));
+    for (Time t=0; t<frames; t++) {
+      for (TId i=0; i<numTraj; i++)
+	frame[i] += v[i] += accel(rng);
+      compressor.addFrame(frame.data());
+    }
+    compressor.finish();
+  }
+  double values = 0;
+  for (auto &a : arrays)
+    values += a.size();
+
+  for (int id : ids) {
+    // e.g. the library codes, if the library is not built
+    if (!codecExists(id)) {
+      cerr << "codec " << id << ": not available\n";
+      continue;
+    }
+    CodecPtr codec = createCodec(id);
+    vector<vector<uint32_t>> encoded(arrays.size());
+    uint64_t bytes = 0;
+    Timer encodeTimer;
+    for (size_t i=0; i<arrays.size(); i++) {
+      encoded[i].resize(codec->require(arrays[i].size()));
+      uint64_t size = encoded[i].size();
+      codec->encodeArray(arrays[i].data(), arrays[i].size(), encoded[i].data(), &size);
+      encoded[i].resize(size);
+      bytes += size * sizeof(uint32_t);
+    }
+    double encodeTime = encodeTimer.diff();
+    vector<uint32_t> decoded;
+    bool ok = true;
+    Timer decodeTimer;
+    for (size_t i=0; i<arrays.size(); i++) {
+      decoded.resize(DECODE_REQUIRE_MEM(arrays[i].size()));
+      codec->decodeArray(encoded[i].data(), encoded[i].size(), decoded.data(), arrays[i].size());
+      ok &= equal(arrays[i].begin(), arrays[i].end(), decoded.begin());
+    }
+    double decodeTime = decodeTimer.diff();
+    if (!ok) {
+      cerr << "codec " << id << " does not reproduce its input\n";
+      return EXIT_FAILURE;
+    }
+    cerr << "codec " << id << ": " << bytes << " bytes, " << 8 * bytes / values << " bits/value\n";
+    print_throughput(encodeTime, values * sizeof(uint32_t) / 1e6, "  encode MB");
+    print_throughput(decodeTime, values * sizeof(uint32_t) / 1e6, "  decode MB");
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  string component = argc > 1 ? argv[1] : "";
+  if (component == "scheduler")   return benchScheduler(argc - 2, argv + 2);
+  if (component == "reconstruct") return benchReconstruct(argc - 2, argv + 2);
+  if (component == "arena")       return benchArena(argc - 2, argv + 2);
+  if (component == "codec")       return benchCodec(argc - 2, argv + 2);
+  cerr << "usage: " << argv[0] << " scheduler [numtraj frames mean-dt]\n"
+       << "       " << argv[0] << " reconstruct [numtraj frames]\n"
+       << "       " << argv[0] << " arena [numtraj frames repeat]\n"
+       << "       " << argv[0] << " codec [numtraj frames codec-id...]\n";
+  return EXIT_FAILURE;
+}
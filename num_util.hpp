@@ -19,6 +19,9 @@
 #pragma once
 
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <boost/integer.hpp>
 using boost::int_t;
 using boost::uint_t;
@@ -51,3 +54,31 @@ int32_t unsigned2signed(uint32_t v) {
   return (v & 1) ? -(v >> 1)
                  :  (v >> 1);
 }
+
+/// quadratic prediction (--quadratic)
+
+// Accelerations are counted in units of quantum / accelerationScale
+// per frame^2.
+const int accelerationScale = 1024;
+
+// Acceleration estimated from two successive segments rising by dx0
+// over dt0 and dx over dt frames (quantized; dt0 = 0: no previous
+// segment): the mean slopes of successive pieces of x = a t^2 differ
+// by a times the sum of their lengths. Computed from the integers of
+// the stream only, so that compressor and decompressor agree exactly.
+int32_t accelerationEstimate(int64_t dx0, uint32_t dt0, int64_t dx, uint32_t dt) {
+  if (!dt0 || !dt) return 0;
+  double num = double(dx * dt0 - dx0 * dt) * accelerationScale;
+  double est = round(num / (double(dt) * dt0 * (uint64_t(dt) + dt0)));
+  return clamp<double>(est, -numeric_limits<int32_t>::max(), numeric_limits<int32_t>::max());
+}
+
+// Acceleration of the next segment, from the last two estimates.
+// Noise makes the estimates scatter; a segment is bent only if they
+// agree in sign and within a factor of two, and then by the smaller.
+int32_t acceleration(int32_t est0, int32_t est) {
+  if (((est0 > 0) != (est > 0)) || !est0 || !est) return 0;
+  int64_t a0 = abs(int64_t(est0)), a = abs(int64_t(est));
+  if ((a > 2 * a0) || (a0 > 2 * a)) return 0;
+  return est > 0 ? min(a, a0) : -min(a, a0);
+}
@@ -0,0 +1,176 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// FIFO between threads holding at most capacity elements. push()
+// blocks while the queue is full, pop() while it is empty. After
+// close() push() fails and pop() drains the remaining elements and
+// then returns false.
+template<typename T>
+struct BoundedQueue {
+  size_t capacity;
+  deque<T> queue;
+  bool closed;
+  mutex lock;
+  condition_variable notFull, notEmpty;
+
+  BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+  bool push(T val) {
+    unique_lock<mutex> l(lock);
+    notFull.wait(l, [&]{ return (queue.size() < capacity) || closed; });
+    if (closed) return false;
+    queue.push_back(move(val));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  bool pop(T &val) {
+    unique_lock<mutex> l(lock);
+    notEmpty.wait(l, [&]{ return queue.size() || closed; });
+    if (queue.empty()) return false;
+    val = move(queue.front());
+    queue.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    unique_lock<mutex> l(lock);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+};
+
+// Collects results that are produced out of order (tagged with a
+// sequence number starting at 0) and hands them out in order. push()
+// blocks while seq is capacity or more ahead of the next element to
+// pop, so that a stalled element bounds what piles up behind it (as
+// BoundedQueue). pop() returns false once the queue is closed and the
+// next element in sequence will never arrive; after close() push()
+// fails.
+template<typename T>
+struct ReorderQueue {
+  size_t capacity;
+  map<uint64_t, T> pending;
+  uint64_t next;
+  bool closed;
+  mutex lock;
+  condition_variable arrived, advanced;
+
+  ReorderQueue(size_t capacity) : capacity(capacity), next(0), closed(false) {}
+
+  bool push(uint64_t seq, T val) {
+    unique_lock<mutex> l(lock);
+    advanced.wait(l, [&]{ return (seq < next + capacity) || closed; });
+    if (closed) return false;
+    pending.insert(make_pair(seq, move(val)));
+    arrived.notify_all();
+    return true;
+  }
+
+  bool pop(T &val) {
+    unique_lock<mutex> l(lock);
+    arrived.wait(l, [&]{ return closed || (pending.size() && pending.begin()->first == next); });
+    if (pending.empty() || pending.begin()->first != next) return false;
+    val = move(pending.begin()->second);
+    pending.erase(pending.begin());
+    next++;
+    advanced.notify_all();
+    return true;
+  }
+
+  void close() {
+    unique_lock<mutex> l(lock);
+    closed = true;
+    arrived.notify_all();
+    advanced.notify_all();
+  }
+};
+
+// Runs a task for the indices 0..size-1 concurrently, one per thread,
+// and waits for all of them. The calling thread runs index 0; the
+// other threads are kept alive between calls, so a task may be as
+// small as one frame.
+struct ForkJoin {
+  int size;
+  vector<thread> threads;
+  mutex lock;
+  condition_variable start, done;
+  function<void(int)> task;
+  uint64_t generation;
+  int running;
+  bool quit;
+
+  ForkJoin(int size) : size(size), generation(0), running(0), quit(false) {
+    for (int i=1; i<size; i++)
+      threads.emplace_back([this, i]() { work(i); });
+  }
+
+  void run(function<void(int)> f) {
+    {
+      unique_lock<mutex> l(lock);
+      task = f;
+      running = size - 1;
+      generation++;
+      start.notify_all();
+    }
+    f(0);
+    unique_lock<mutex> l(lock);
+    done.wait(l, [&]{ return !running; });
+  }
+
+  void work(int i) {
+    uint64_t seen = 0;
+    for (;;) {
+      function<void(int)> f;
+      {
+	unique_lock<mutex> l(lock);
+	start.wait(l, [&]{ return quit || (generation != seen); });
+	if (quit) return;
+	seen = generation;
+	f = task;
+      }
+      f(i);
+      unique_lock<mutex> l(lock);
+      if (!--running) done.notify_one();
+    }
+  }
+
+  ~ForkJoin() {
+    {
+      unique_lock<mutex> l(lock);
+      quit = true;
+      start.notify_all();
+    }
+    for (auto &t : threads)
+      t.join();
+  }
+};
@@ -0,0 +1,90 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "common.hpp"
+
+// Periodic boundary conditions of a rectangular box. A particle
+// crossing the box boundary jumps by a box length, which ends its
+// segment and costs a large v. So the compressor is given unwrapped
+// trajectories instead: every jump by more than half a box length is
+// undone by shifting the rest of the trajectory by whole box lengths.
+// The shifts start at 0 in every block, so that blocks stay
+// independent and key frames within bound. On decompression the
+// values are wrapped back into [0, L).
+//
+// period holds the box length of each trajectory (0: not periodic);
+// trajectory i is dimension i % box.size() of a particle.
+template<typename Real>
+vector<Real> trajectoryPeriods(const vector<double> &box, TId numTraj) {
+  vector<Real> period(numTraj);
+  for (TId i=0; i<numTraj; i++)
+    period[i] = box[i % box.size()];
+  return period;
+}
+
+template<typename Real>
+struct Unwrapper {
+  vector<Real> period, shift, last;
+  bool first;
+
+  Unwrapper(const vector<Real> &period)
+    : period(period),
+      shift(period.size()),
+      last(period.size()),
+      first(true)
+  {}
+
+  // start a new block
+  void reset() {
+    fill(shift.begin(), shift.end(), Real(0));
+    first = true;
+  }
+
+  // unwrap frame src into dst (which may be the same)
+  void operator()(const Real *src, Real *dst) {
+    for (size_t i=0; i<period.size(); i++) {
+      Real x = src[i] + shift[i];
+      if (!first && period[i]) {
+	Real jump = round((x - last[i]) / period[i]) * period[i];
+	shift[i] -= jump;
+	x -= jump;
+      }
+      dst[i] = last[i] = x;
+    }
+    first = false;
+  }
+};
+
+// wrap frame (numTraj values) back into [0, period)
+template<typename Real>
+void wrapFrame(const Real *period, Real *frame, TId numTraj) {
+  for (TId i=0; i<numTraj; i++) {
+    if (!period[i]) continue;
+    // the remainder may round to either end of the interval
+    Real x = frame[i] - floor(frame[i] / period[i]) * period[i];
+    if (x < 0)          x += period[i];
+    if (x >= period[i]) x -= period[i];
+    frame[i] = x;
+  }
+}
@@ -0,0 +1,168 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "common.hpp"
+
+// Monotone priority queue of space time points (a radix heap). It
+// exploits that the scheduler never pushes a point that lies before
+// the last one popped: keys are bucketed by the highest bit in which
+// they differ from the last minimum. Each key is moved to a lower
+// bucket at most log2(maxTime * maxTId) times; buckets keep their
+// capacity, so no allocation happens once the heap is warmed up.
+struct STPHeap {
+  // (time, id) packed so that integer order equals STP order
+  static uint64_t key(STP p) { return (uint64_t(p.time) << 16) | p.id; }
+  static STP stp(uint64_t k) {
+    STP p;
+    p.time = k >> 16;
+    p.id   = k & 0xffff;
+    return p;
+  }
+
+  vector<uint64_t> bucket[65];
+  uint64_t last;
+  size_t count;
+
+  STPHeap() : last(0), count(0) {}
+
+  static int bucketOf(uint64_t k, uint64_t last) {
+    return k == last ? 0 : 64 - __builtin_clzll(k ^ last);
+  }
+
+  void push(STP p) {
+    uint64_t k = key(p);
+    assert(k >= last);
+    bucket[bucketOf(k, last)].push_back(k);
+    count++;
+  }
+
+  bool empty() const { return !count; }
+  size_t size() const { return count; }
+
+  STP top() {
+    assert(count);
+    if (bucket[0].empty()) {
+      // Pull the smallest non-empty bucket and spread it over the
+      // buckets below, relative to its minimum.
+      int i = 1;
+      while (bucket[i].empty()) i++;
+      vector<uint64_t> &b = bucket[i];
+      last = *min_element(b.begin(), b.end());
+      for (auto k : b)
+	bucket[bucketOf(k, last)].push_back(k);
+      b.clear();
+    }
+    return stp(last);
+  }
+
+  void pop() {
+    top();
+    bucket[0].pop_back();
+    count--;
+  }
+};
+
+// Order in which the compressor has to emit support vectors and the
+// ones it already knows. Each trajectory has exactly one expected
+// segment (the one the decoder will ask for next). Known segments of
+// a trajectory are completed in time order, so they are kept in a
+// per trajectory FIFO whose head always is the expected segment of
+// that trajectory. FIFO nodes live in one pool and are recycled via a
+// free list.
+struct SegmentSchedule {
+  static const uint32_t nil = -1;
+
+  struct Node {
+    SVI svi;
+    uint32_t next;
+  };
+
+  STPHeap expected;
+  vector<Node> pool;
+  uint32_t freeNode;
+  vector<uint32_t> head, tail; // per trajectory
+
+  SegmentSchedule(TId numTraj)
+    : freeNode(nil),
+      head(numTraj, nil),
+      tail(numTraj, nil)
+  {}
+
+  void expect(STP stp) { expected.push(stp); }
+
+  // register a completed segment of trajectory id
+  void know(TId id, SVI svi) {
+    uint32_t n;
+    if (freeNode != nil) {
+      n = freeNode;
+      freeNode = pool[n].next;
+    }else{
+      n = pool.size();
+      pool.push_back(Node());
+    }
+    pool[n].svi = svi;
+    pool[n].next = nil;
+    if (tail[id] != nil) { pool[tail[id]].next = n; }
+    else                 { head[id] = n; }
+    tail[id] = n;
+  }
+
+  bool empty() { return expected.empty(); }
+  STP top() { return expected.top(); }
+  bool known(TId id) const { return head[id] != nil; }
+
+  // Is the support vector the decoder needs next already known?
+  bool ready() { return !expected.empty() && known(expected.top().id); }
+
+  // Pop the next expected segment, which must be known, and expect
+  // the one following it.
+  SVI next() {
+    SVI svi;
+    next(&svi, 1);
+    return svi;
+  }
+
+  // Same for a group of dim trajectories scheduled under one id, whose
+  // segments are known as dim consecutive SVIs with the same dt.
+  void next(SVI *svi, int dim) {
+    STP es = expected.top();
+    for (int k=0; k<dim; k++) {
+      uint32_t n = head[es.id];
+      assert(n != nil);
+      svi[k] = pool[n].svi;
+      head[es.id] = pool[n].next;
+      if (head[es.id] == nil) tail[es.id] = nil;
+      pool[n].next = freeNode;
+      freeNode = n;
+    }
+
+    expected.pop();
+    STP newSeg;
+    newSeg.time = es.time + svi[0].dt + 1;
+    newSeg.id = es.id;
+    expected.push(newSeg);
+  }
+
+  // Pop the next expected segment without expecting a successor.
+  void drop() { expected.pop(); }
+};
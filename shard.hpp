@@ -0,0 +1,220 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common.hpp"
+#include "compressor.hpp"
+#include "decompressor.hpp"
+#include "format.hpp"
+#include "parallel.hpp"
+
+// A sharded block splits the trajectories into numShards ranges of
+// consecutive ids. Each range is compressed by its own CompressorState
+// into an ordinary sub-stream (key frame, SVI chunks, empty chunk).
+// The block starts with a directory
+//
+//   ShardHeader, ShardEntry[numShards], sub-stream[0], sub-stream[1], ...
+//
+// so that a decoder can locate every sub-stream without parsing the
+// others, and decode a subset of the trajectories without touching
+// the sub-streams of the others at all.
+struct ShardHeader {
+  uint32_t numShards;
+  uint32_t numTraj; // sum over all shards
+};
+
+struct ShardEntry {
+  uint32_t numTraj; // trajectories in this shard
+  uint32_t reserved;
+  uint64_t size;    // bytes of the sub-stream
+};
+
+// number of trajectories in shard s when splitting numTraj evenly
+// (in groups of dim, see TrajState)
+inline TId shardSize(TId numTraj, int numShards, int s, int dim = 1) {
+  uint64_t numGroups = numTraj / dim;
+  return dim * ((numGroups * (s + 1)) / numShards
+	      - (numGroups *  s     ) / numShards);
+}
+
+// Compresses one block with one CompressorState per shard; the
+// threads of pool take turns over the shards. Frames are handed to
+// all shards at once, so each addFrame() is parallel in itself. The
+// block is passed to sink as a whole by finish(). factory is called
+// with the first trajectory and the number of trajectories of a shard.
+template<typename Real>
+struct ShardedCompressor {
+  typedef function<CompressorState<Real>*(TId, TId, ChunkSink)> Factory;
+
+  int numShards;
+  vector<TId> firstTraj; // numShards + 1 entries
+  vector<CompressorState<Real>*> shard;
+  vector<vector<char>> out;
+  ForkJoin &pool;
+  function<void(const char*, size_t)> sink;
+
+  ShardedCompressor(TId numTraj, int numShards, ForkJoin &pool, Factory factory,
+		    function<void(const char*, size_t)> sink, int dim = 1)
+    : numShards(numShards),
+      firstTraj(1, 0),
+      out(numShards),
+      pool(pool),
+      sink(sink)
+  {
+    for (int s=0; s<numShards; s++) {
+      TId size = shardSize(numTraj, numShards, s, dim);
+      assert(size); // an empty key frame has no bit width
+      firstTraj.push_back(firstTraj.back() + size);
+      shard.push_back(factory(firstTraj.back() - size, size, appendChunks(out[s])));
+    }
+  }
+
+  void addFrame(const Real *trajVal) {
+    pool.run([&](int t) {
+      for (int s=t; s<numShards; s+=pool.size)
+	shard[s]->addFrame(trajVal + firstTraj[s]);
+    });
+  }
+
+  void finish() {
+    pool.run([&](int t) {
+      for (int s=t; s<numShards; s+=pool.size)
+	shard[s]->finish();
+    });
+
+    ShardHeader header;
+    header.numShards = numShards;
+    header.numTraj = firstTraj.back();
+    sink((char*) &header, sizeof(header));
+    for (int s=0; s<numShards; s++) {
+      ShardEntry entry;
+      entry.numTraj = firstTraj[s+1] - firstTraj[s];
+      entry.reserved = 0;
+      entry.size = out[s].size();
+      sink((char*) &entry, sizeof(entry));
+    }
+    for (auto &o : out)
+      sink(o.data(), o.size());
+  }
+
+  ~ShardedCompressor() {
+    for (auto c : shard)
+      delete c;
+  }
+};
+
+// Reads a sharded block from a file descriptor. Returns false at the
+// end of the stream (which may be marked by an empty directory).
+//
+// If given, wanted(firstTraj, numTraj) selects the shards to load.
+// The others are skipped (by seeking if possible) and get size 0 in
+// the directory of the returned block.
+inline bool readShardedBlock(int fd, vector<char> &block,
+			     function<bool(TId, TId)> wanted = nullptr) {
+  ShardHeader header;
+  if (!readAll(fd, (char*) &header, sizeof(header))) return false;
+  if (!header.numShards) return false;
+  vector<ShardEntry> entry(header.numShards);
+  assert(readAll(fd, (char*) entry.data(), sizeof(ShardEntry) * header.numShards));
+  vector<uint64_t> skip(header.numShards, 0);
+  TId firstTraj = 0;
+  for (uint32_t s=0; s<header.numShards; s++) {
+    if (wanted && !wanted(firstTraj, entry[s].numTraj)) {
+      skip[s] = entry[s].size;
+      entry[s].size = 0;
+    }
+    firstTraj += entry[s].numTraj;
+  }
+  uint64_t size = sizeof(header) + sizeof(ShardEntry) * header.numShards;
+  for (auto e : entry)
+    size += e.size;
+  block.resize(size);
+  char *cur = block.data();
+  memcpy(cur, &header, sizeof(header));        cur += sizeof(header);
+  memcpy(cur, entry.data(), sizeof(ShardEntry) * header.numShards);
+  cur += sizeof(ShardEntry) * header.numShards;
+  for (uint32_t s=0; s<header.numShards; s++) {
+    if (skip[s]) {
+      if (lseek(fd, skip[s], SEEK_CUR) < 0)
+	assert(skipAll(fd, skip[s]));
+    }else{
+      assert(readAll(fd, cur, entry[s].size));
+      cur += entry[s].size;
+    }
+  }
+  return true;
+}
+
+// Decodes a sharded block held in memory, one DecompressorState per
+// shard, shared among the threads of pool. Each readFrame()
+// reconstructs the frame slices of all shards concurrently. Shards
+// with size 0 in the directory (not loaded by readShardedBlock) are
+// not decoded; their slices of the frame are left untouched. factory
+// is called as for ShardedCompressor.
+template<typename Real>
+struct ShardedDecompressor {
+  typedef function<DecompressorState<Real>*(TId, TId, ChunkSource)> Factory;
+
+  vector<char> block;
+  vector<TId> firstTraj; // of the decoded shards
+  vector<DecompressorState<Real>*> shard;
+  ForkJoin &pool;
+
+  ShardedDecompressor(vector<char> &&blockData, ForkJoin &pool, Factory factory)
+    : block(move(blockData)),
+      pool(pool)
+  {
+    ShardHeader header;
+    memcpy(&header, block.data(), sizeof(header));
+    const char *entries = block.data() + sizeof(header);
+    const char *data = entries + sizeof(ShardEntry) * header.numShards;
+    TId numTraj = 0;
+    for (uint32_t s=0; s<header.numShards; s++) {
+      ShardEntry entry;
+      memcpy(&entry, entries + s * sizeof(entry), sizeof(entry));
+      numTraj += entry.numTraj;
+      if (!entry.size) continue;
+      firstTraj.push_back(numTraj - entry.numTraj);
+      shard.push_back(factory(firstTraj.back(), entry.numTraj, readChunks(data, data + entry.size)));
+      data += entry.size;
+    }
+    assert(numTraj == header.numTraj);
+    assert(shard.size());
+  }
+
+  bool readFrame(Real *trajDst) {
+    vector<char> ok(shard.size());
+    pool.run([&](int t) {
+      for (size_t s=t; s<shard.size(); s+=pool.size)
+	ok[s] = shard[s]->readFrame(trajDst ? trajDst + firstTraj[s] : nullptr);
+    });
+    for (auto o : ok)
+      assert(o == ok[0]);
+    return ok[0];
+  }
+
+  ~ShardedDecompressor() {
+    for (auto d : shard)
+      delete d;
+  }
+};
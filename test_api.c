@@ -0,0 +1,137 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* Round trip through the C API of hrtc.h, checked against the
+   command line tool:
+
+     test_api TSV NUMTRAJ BOUND ERROR COMPRESSED DECOMPRESSED
+
+   pushes the frames of TSV (as float) through an encoder, compares
+   the stream with COMPRESSED (written by hrtc --compress
+   --format=tsvfloat), then feeds it to a decoder in pieces of random
+   size and compares the frames with DECOMPRESSED (hrtc --decompress).
+   Exits with 1 at the first difference. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hrtc.h"
+
+static int fail(const char *msg, long pos) {
+  fprintf(stderr, "test_api: %s at %ld\n", msg, pos);
+  return 1;
+}
+
+/* read a TSV line of n values; returns 0 at the end of the file */
+static int readFrame(FILE *f, float *frame, uint32_t n) {
+  for (uint32_t i=0; i<n; i++)
+    if (fscanf(f, "%f", frame + i) != 1) return 0;
+  return 1;
+}
+
+/* whole content of a file */
+static char *readFile(const char *name, size_t *size) {
+  FILE *f = fopen(name, "rb");
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *res = malloc(*size + 1);
+  if (fread(res, 1, *size, f) != *size) { free(res); res = NULL; }
+  fclose(f);
+  return res;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 7) {
+    fprintf(stderr, "usage: test_api TSV NUMTRAJ BOUND ERROR COMPRESSED DECOMPRESSED\n");
+    return 2;
+  }
+  hrtc_params p;
+  hrtc_params_default(&p);
+  p.num_traj = atoi(argv[2]);
+  p.bound = atof(argv[3]);
+  p.error = atof(argv[4]);
+  p.precision = HRTC_FLOAT;
+
+  size_t refSize;
+  char *ref = readFile(argv[5], &refSize);
+  FILE *src = fopen(argv[1], "r");
+  float *frame = malloc(sizeof(float) * p.num_traj);
+  float *decoded = malloc(sizeof(float) * p.num_traj);
+  if (!ref || !src || !frame || !decoded) return fail("cannot read input", 0);
+
+  /* encode and compare with the stream of the command line tool */
+  char *stream = malloc(refSize + 1);
+  size_t size = 0;
+  hrtc_encoder *enc = hrtc_encoder_new(&p);
+  if (!enc) return fail("invalid parameters", 0);
+  long frames = 0;
+  while (readFrame(src, frame, p.num_traj)) {
+    if (hrtc_push_frame(enc, frame) != HRTC_OK) return fail("push failed", frames);
+    frames++;
+    size_t n = hrtc_encoder_available(enc);
+    if (size + n > refSize) return fail("stream too long", size + n);
+    size += hrtc_encoder_read(enc, stream + size, n);
+  }
+  if (hrtc_encoder_finish(enc) != HRTC_OK) return fail("finish failed", frames);
+  if (hrtc_push_frame(enc, frame) != HRTC_ERROR) return fail("push after finish", frames);
+  size_t n = hrtc_encoder_available(enc);
+  if (size + n > refSize) return fail("stream too long", size + n);
+  size += hrtc_encoder_read(enc, stream + size, n);
+  hrtc_encoder_free(enc);
+  fclose(src);
+  if (size != refSize) return fail("stream too short", size);
+  for (size_t i=0; i<size; i++)
+    if (stream[i] != ref[i]) return fail("stream differs", i);
+
+  /* decode in random pieces and compare with the command line tool */
+  FILE *out = fopen(argv[6], "r");
+  if (!out) return fail("cannot read output", 0);
+  hrtc_decoder *dec = hrtc_decoder_new(&p);
+  if (!dec) return fail("invalid parameters", 0);
+  srand(1);
+  size_t pos = 0;
+  long pulled = 0;
+  hrtc_status status;
+  do {
+    if (pos < size) {
+      size_t piece = 1 + rand() % 4096;
+      if (piece > size - pos) piece = size - pos;
+      if (hrtc_decoder_write(dec, stream + pos, piece) != HRTC_OK) return fail("write failed", pos);
+      pos += piece;
+    }
+    while ((status = hrtc_pull_frame(dec, decoded)) == HRTC_OK) {
+      if (!readFrame(out, frame, p.num_traj)) return fail("too many frames", pulled);
+      if (memcmp(frame, decoded, sizeof(float) * p.num_traj)) return fail("frame differs", pulled);
+      pulled++;
+    }
+    if (status == HRTC_ERROR) return fail("pull failed", pulled);
+  } while ((status == HRTC_NEED_INPUT) && (pos < size));
+  if (status != HRTC_END) return fail("stream did not end", pulled);
+  if (pulled != frames) return fail("too few frames", pulled);
+  hrtc_decoder_free(dec);
+  fclose(out);
+
+  free(ref);
+  free(stream);
+  free(frame);
+  free(decoded);
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* Copyright 2014-2016 Jan Huwald, Stephan Richter
+
+   This file is part of HRTC.
+
+   HRTC is free software: you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   HRTC is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program (see file LICENSE).  If not, see
+   <http://www.gnu.org/licenses/>. */
+
+/* Round trip through the TNG plugin of hrtc_wrapper.cpp, with the
+   few TNG functions it calls replaced by the ones below:
+
+     test_wrapper
+
+   compresses a trajectory of three framesets, the last one shorter,
+   and decodes them with hrtc_uncompress_many, hrtc_uncompress_into
+   and hrtc_uncompress. Then checks that framesets whose box changes
+   are rejected with periodic boundaries. Exits with 1 at the first
+   difference. */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+extern "C" {
+#include <tng/tng_io.h>
+
+tng_function_status hrtc_compress(const tng_trajectory_t, const int64_t, const int64_t,
+                                  const char, char **, int64_t *);
+tng_function_status hrtc_uncompress(const tng_trajectory_t, const char, char **);
+tng_function_status hrtc_uncompress_into(const tng_trajectory_t, const char, const int64_t,
+                                         const char *, void *);
+tng_function_status hrtc_uncompress_many(const tng_trajectory_t, const char, const int64_t,
+                                         const int64_t *, const char **, void **, const int);
+void hrtc_set_pbc(const int);
+}
+
+const int64_t framesPerSet = 50, numParticles = 100, dims = 3;
+const double precision = 1000, boxLength = 10;
+
+// the trajectory as the wrapper sees it: the frames of the current
+// frameset have one box each, which grows by boxGrowth per frame
+static int64_t currentFrames = framesPerSet;
+static double boxGrowth = 0;
+static vector<data_values> boxValues;
+static vector<data_values*> boxRows;
+
+extern "C" {
+tng_function_status tng_data_get(tng_trajectory_t, int64_t, data_values ***values,
+                                 int64_t *n_frames, int64_t *n_values, char *type) {
+  boxValues.resize(currentFrames * dims);
+  boxRows.resize(currentFrames);
+  for (int64_t f=0; f<currentFrames; f++) {
+    for (int64_t d=0; d<dims; d++)
+      boxValues[f * dims + d].d = boxLength + f * boxGrowth;
+    boxRows[f] = boxValues.data() + f * dims;
+  }
+  *values = boxRows.data();
+  *n_frames = currentFrames;
+  *n_values = dims;
+  *type = TNG_DOUBLE_DATA;
+  return TNG_SUCCESS;
+}
+
+tng_function_status tng_compression_precision_get(tng_trajectory_t, double *p) {
+  *p = precision;
+  return TNG_SUCCESS;
+}
+
+tng_function_status tng_num_molecules_get(tng_trajectory_t, int64_t *n) {
+  *n = numParticles;
+  return TNG_SUCCESS;
+}
+
+tng_function_status tng_num_frames_per_frame_set_get(tng_trajectory_t, int64_t *n) {
+  *n = framesPerSet;
+  return TNG_SUCCESS;
+}
+}
+
+static int fail(const char *msg, long pos) {
+  fprintf(stderr, "test_wrapper: %s at %ld\n", msg, pos);
+  return 1;
+}
+
+int main() {
+  const int64_t numTraj = numParticles * dims;
+  vector<int64_t> frames = {framesPerSet, framesPerSet, 17};
+  vector<vector<float>> orig;
+  vector<char*> compressed;
+  for (auto n : frames) {
+    orig.emplace_back(n * numTraj);
+    auto &set = orig.back();
+    for (size_t i=0; i<set.size(); i++)
+      set[i] = boxLength / 2 + 4 * sin(i % numTraj + 0.01 * (orig.size() * framesPerSet + i / numTraj));
+    char *data = (char*) malloc(set.size() * sizeof(float));
+    memcpy(data, set.data(), set.size() * sizeof(float));
+    int64_t len;
+    currentFrames = n;
+    if (hrtc_compress(nullptr, n, numParticles, TNG_FLOAT_DATA, &data, &len) != TNG_SUCCESS)
+      return fail("compression failed", orig.size() - 1);
+    compressed.push_back(data);
+  }
+  currentFrames = framesPerSet;
+
+  // all framesets at once, within error plus rounding (quantum/2 each)
+  vector<vector<float>> many;
+  vector<void*> dst;
+  for (auto n : frames) {
+    many.emplace_back(n * numTraj);
+    dst.push_back(many.back().data());
+  }
+  if (hrtc_uncompress_many(nullptr, TNG_FLOAT_DATA, frames.size(), frames.data(),
+                           (const char**) compressed.data(), dst.data(), 2) != TNG_SUCCESS)
+    return fail("hrtc_uncompress_many failed", 0);
+  for (size_t s=0; s<frames.size(); s++)
+    for (size_t i=0; i<orig[s].size(); i++)
+      if (fabs(many[s][i] - orig[s][i]) > 1 / precision)
+        return fail("value differs", s * framesPerSet * numTraj + i);
+
+  // one frameset, which has to hold exactly the given number of frames
+  vector<float> one((frames.back() + 1) * numTraj);
+  if (hrtc_uncompress_into(nullptr, TNG_FLOAT_DATA, frames.back(), compressed.back(), one.data()) != TNG_SUCCESS)
+    return fail("hrtc_uncompress_into failed", frames.size() - 1);
+  if (memcmp(one.data(), many.back().data(), many.back().size() * sizeof(float)))
+    return fail("hrtc_uncompress_into differs", frames.size() - 1);
+  if ((hrtc_uncompress_into(nullptr, TNG_FLOAT_DATA, frames.back() - 1, compressed.back(), one.data()) != TNG_FAILURE)
+      || (hrtc_uncompress_into(nullptr, TNG_FLOAT_DATA, frames.back() + 1, compressed.back(), one.data()) != TNG_FAILURE))
+    return fail("wrong frame count accepted", frames.size() - 1);
+
+  // full framesets as TNG reads them
+  if (hrtc_uncompress(nullptr, TNG_FLOAT_DATA, &compressed[0]) != TNG_SUCCESS)
+    return fail("hrtc_uncompress failed", 0);
+  if (memcmp(compressed[0], many[0].data(), many[0].size() * sizeof(float)))
+    return fail("hrtc_uncompress differs", 0);
+
+  // periodic boundaries need the same box in all frames
+  hrtc_set_pbc(1);
+  int64_t len;
+  char *data = (char*) malloc(orig[1].size() * sizeof(float));
+  memcpy(data, orig[1].data(), orig[1].size() * sizeof(float));
+  if (hrtc_compress(nullptr, framesPerSet, numParticles, TNG_FLOAT_DATA, &data, &len) != TNG_SUCCESS)
+    return fail("periodic compression failed", 1);
+  compressed.push_back(data);
+  data = (char*) malloc(orig[1].size() * sizeof(float));
+  memcpy(data, orig[1].data(), orig[1].size() * sizeof(float));
+  boxGrowth = 0.1;
+  if (hrtc_compress(nullptr, framesPerSet, numParticles, TNG_FLOAT_DATA, &data, &len) != TNG_FAILURE)
+    return fail("changing box accepted", 1);
+  free(data);
+
+  for (auto c : compressed) free(c);
+  return 0;
+}